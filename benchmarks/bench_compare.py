@@ -0,0 +1,242 @@
+"""Matcher benchmarks on synthetic PDG-like databases.
+
+    python benchmarks/bench_compare.py --rows=100000 --mutation=0.01
+
+Each matcher runs in a fresh process, so the reported peak RSS belongs to
+that matcher alone (ru_maxrss only ever grows, so it is sampled after
+each phase). --startup also times whole CLI invocations on a tiny table:
+the module import, --help, and a diff with and without --lite.
+"""
+
+from concurrent.futures import ProcessPoolExecutor
+from dataclasses import asdict, dataclass
+import json
+import os
+import random
+import resource
+import sqlite3
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+from pdgapi_diff.cli.pdgapi_diff import DB, MATCHERS, Writer, compare
+
+
+# (name, type) pairs modelled on the pdgdata table; wider tables repeat them
+PDG_COLUMNS = [
+    ('pdgid', 'TEXT'),
+    ('edition', 'TEXT'),
+    ('value_type', 'TEXT'),
+    ('in_summary_table', 'INTEGER'),
+    ('confidence_level', 'REAL'),
+    ('limit_type', 'TEXT'),
+    ('comment', 'TEXT'),
+    ('value', 'REAL'),
+    ('error_positive', 'REAL'),
+    ('error_negative', 'REAL'),
+    ('unit_text', 'TEXT'),
+    ('display_power_of_ten', 'INTEGER'),
+    ('sort', 'INTEGER'),
+]
+
+
+def make_columns(n_cols: int) -> list[tuple[str, str]]:
+    cols = []
+    for k in range(n_cols):
+        name, typ = PDG_COLUMNS[k % len(PDG_COLUMNS)]
+        cols.append((name if k < len(PDG_COLUMNS) else f'{name}_{k}', typ))
+    return cols
+
+
+def random_value(rng: random.Random, typ: str, cardinality: int):
+    match typ:
+        case 'TEXT':
+            return f's{rng.randrange(cardinality)}'
+        case 'INTEGER':
+            return rng.randrange(cardinality)
+        case 'REAL':
+            return round(rng.uniform(0, 100), 3)
+
+
+def make_tables(rows: int, cols: list[tuple[str, str]], cardinality: int,
+                mutation: float, seed: int) -> tuple[list, list]:
+    rng = random.Random(seed)
+    rows1 = [tuple(random_value(rng, typ, cardinality) for _, typ in cols)
+             for _ in range(rows)]
+
+    # a mutated row has one column changed; deletes and inserts each take
+    # a quarter of the mutation budget
+    rows2 = []
+    for row in rows1:
+        x = rng.random()
+        if x < mutation / 4:
+            continue
+        if x < mutation:
+            c = rng.randrange(len(cols))
+            row = list(row)
+            row[c] = random_value(rng, cols[c][1], cardinality)
+            row = tuple(row)
+        rows2.append(row)
+    rows2 += [tuple(random_value(rng, typ, cardinality) for _, typ in cols)
+              for _ in range(int(rows * mutation / 4))]
+    rng.shuffle(rows2)
+    return rows1, rows2
+
+
+def write_db(path: str, table: str, cols: list[tuple[str, str]],
+             rows: list[tuple]):
+    conn = sqlite3.connect(path)
+    decl = ', '.join(f'{name} {typ}' for name, typ in cols)
+    conn.execute(f'CREATE TABLE {table} (id INTEGER PRIMARY KEY, {decl})')
+    marks = ', '.join('?' * len(cols))
+    names = ', '.join(name for name, _ in cols)
+    conn.executemany(f'INSERT INTO {table} ({names}) VALUES ({marks})', rows)
+    conn.commit()
+    conn.close()
+
+
+@dataclass
+class Result:
+    matcher: str
+    phase: str
+    seconds: float
+    rows_per_sec: float
+    peak_rss_mib: float
+
+
+def peak_rss_mib() -> float:
+    # ru_maxrss is KiB on Linux, bytes on macOS
+    scale = 1 if sys.platform == 'darwin' else 1024
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * scale / 2**20
+
+
+def run_matcher(path1: str, path2: str, table: str, matcher: str,
+                max_dist: int) -> list[Result]:
+    results = []
+
+    def timed(phase, fn, count):
+        t0 = time.perf_counter()
+        out = fn()
+        dt = time.perf_counter() - t0
+        results.append(Result(matcher, phase, dt, count(out) / dt,
+                              peak_rss_mib()))
+        return out
+
+    db1, db2 = DB(path1), DB(path2)
+    rows1, rows2 = timed(
+        'get_all',
+        lambda: (db1.get_all(table, ['id']), db2.get_all(table, ['id'])),
+        lambda out: len(out[0]) + len(out[1]))
+
+    deltas = timed(
+        'compare',
+        lambda: list(compare(rows1, rows2, max_dist, matcher,
+                             progress=False)),
+        lambda _: len(rows1) + len(rows2))
+
+    def write():
+        with open(os.devnull, 'w') as out, Writer(out, color=True) as w:
+            w.write_deltas(deltas)
+    timed('pprint', write, lambda _: len(deltas))
+    return results
+
+
+def startup_times(path1: str, path2: str, table: str,
+                  repeat: int) -> dict[str, float]:
+    # median wall time of each command, each run in a fresh interpreter
+    def cli(*args):
+        argv = ['pdgapi-diff', *args]
+        return ('import sys; from pdgapi_diff.cli.pdgapi_diff import main; '
+                f'sys.argv = {argv!r}; main()')
+
+    diff = (path1, path2, f'--table={table}', '--color=False')
+    commands = {
+        'import': 'import pdgapi_diff.cli.pdgapi_diff',
+        'help': cli('--help'),
+        'diff': cli(*diff),
+        'diff --lite': cli(*diff, '--lite'),
+    }
+    times = {}
+    for name, code in commands.items():
+        samples = []
+        for _ in range(repeat):
+            t0 = time.perf_counter()
+            proc = subprocess.run([sys.executable, '-c', code],
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=subprocess.PIPE, text=True)
+            samples.append(time.perf_counter() - t0)
+            if proc.returncode:
+                # a crash would otherwise be timed as a fast startup
+                raise RuntimeError(f'{name!r} exited with status '
+                                   f'{proc.returncode}:\n{proc.stderr}')
+        times[name] = statistics.median(samples)
+    return times
+
+
+def available_matchers() -> list[str]:
+    names = list(MATCHERS)
+    try:
+        import numpy
+    except ImportError:
+        names.remove('columnar')
+    return names
+
+
+def main(rows: int = 20_000, cols: int = 13, cardinality: int = 1000,
+         mutation: float = 0.01, max_dist: int = 1, matchers = None,
+         seed: int = 0, json_out: str | None = None, startup = False,
+         startup_repeat: int = 10):
+    table = 'pdgdata'
+    columns = make_columns(cols)
+    rows1, rows2 = make_tables(rows, columns, cardinality, mutation, seed)
+    matchers = matchers or available_matchers()
+    if isinstance(matchers, str):
+        matchers = matchers.split(',')
+
+    results: list[Result] = []
+    with tempfile.TemporaryDirectory() as tmp:
+        path1, path2 = os.path.join(tmp, 'a.db'), os.path.join(tmp, 'b.db')
+        write_db(path1, table, columns, rows1)
+        write_db(path2, table, columns, rows2)
+        for matcher in matchers:
+            with ProcessPoolExecutor(1) as pool:
+                results += pool.submit(run_matcher, path1, path2, table,
+                                       matcher, max_dist).result()
+
+        startup_results = {}
+        if startup:
+            small1, small2 = (os.path.join(tmp, 'small_a.db'),
+                              os.path.join(tmp, 'small_b.db'))
+            tiny1, tiny2 = make_tables(100, columns, cardinality, mutation,
+                                       seed)
+            write_db(small1, table, columns, tiny1)
+            write_db(small2, table, columns, tiny2)
+            startup_results = startup_times(small1, small2, table,
+                                            startup_repeat)
+
+    print(f'{rows} rows x {cols} cols, cardinality {cardinality}, '
+          f'mutation {mutation}, max_dist {max_dist}')
+    print(f'{"matcher":<12}{"phase":<10}{"seconds":>10}{"rows/s":>14}'
+          f'{"peak MiB":>10}')
+    for r in results:
+        print(f'{r.matcher:<12}{r.phase:<10}{r.seconds:>10.3f}'
+              f'{r.rows_per_sec:>14,.0f}{r.peak_rss_mib:>10.1f}')
+
+    if startup_results:
+        print(f'\n{"startup":<16}{"seconds":>10}')
+        for name, seconds in startup_results.items():
+            print(f'{name:<16}{seconds:>10.3f}')
+
+    if json_out:
+        out = [asdict(r) for r in results]
+        out += [{'startup': name, 'seconds': seconds}
+                for name, seconds in startup_results.items()]
+        with open(json_out, 'w') as f:
+            json.dump(out, f, indent=2)
+
+
+if __name__ == '__main__':
+    import fire
+    fire.Fire(main)
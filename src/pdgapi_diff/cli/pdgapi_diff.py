@@ -1,53 +1,967 @@
-from dataclasses import dataclass
+from array import array
+from collections import Counter, defaultdict
+from contextlib import contextmanager, nullcontext
+from dataclasses import asdict, dataclass, field
+from decimal import Decimal
 from enum import auto, Enum
+from functools import partial
+import hashlib
+import heapq
+from itertools import groupby
+import json
+import mmap
+import os
+from queue import Queue
+import sys
+from threading import Thread
+import time
+from typing import Iterable, Iterator, TextIO
+from urllib.parse import quote as urlquote
 
-from colorama import Fore, Style
-import sqlalchemy
-from sqlalchemy import select
+# SQLAlchemy, colorama, tqdm and the process pools are imported where they
+# are first used, so --help loads none of them and --lite skips SQLAlchemy
 
-from tqdm import tqdm
 
-
-@dataclass
+@dataclass(slots=True, frozen=True)
 class Row:
     vals: list[tuple]
     matched_vals: list[tuple]
 
 
-@dataclass
+# Deltas hold references to row tuples rather than copies of them, and slots
+# keep the per-delta overhead to a few pointers. The tuples are the fetched
+# rows, except with interning, where each delta's rows are decoded afresh
+# from the codes.
+@dataclass(slots=True, frozen=True)
 class Delta:
     row: tuple
 
-@dataclass
+@dataclass(slots=True, frozen=True)
 class Insert(Delta):
     pass
 
-@dataclass
+@dataclass(slots=True, frozen=True)
 class Delete(Delta):
     pass
 
-@dataclass
+@dataclass(slots=True, frozen=True)
 class Update(Delta):
     new_row: tuple
+    changed: tuple[int, ...] | None = None
+
+
+def changed_cols(row1: tuple, row2: tuple) -> tuple[int, ...]:
+    return tuple(c for c, (v1, v2) in enumerate(zip(row1, row2))
+                 if v1 != v2)
+
+
+@dataclass(slots=True)
+class Summary:
+    # Per-table delta counts, plus how many Updates touched each column.
+    # unchanged is None when the diff mode never sees unchanged rows.
+    table: str
+    columns: list[str]
+    inserted: int = 0
+    deleted: int = 0
+    updated: int = 0
+    unchanged: int | None = 0
+    col_changes: list[int] = field(default_factory=list)
+
+    def __post_init__(self):
+        self.col_changes = self.col_changes or [0] * len(self.columns)
+
+    def add_update(self, changed: Iterable[int]):
+        self.updated += 1
+        for c in changed:
+            self.col_changes[c] += 1
+
+    def add_delta(self, d: Delta):
+        match d:
+            case Insert():
+                self.inserted += 1
+            case Delete():
+                self.deleted += 1
+            case Update(old_row, new_row, changed):
+                if changed is None:
+                    changed = changed_cols(old_row, new_row)
+                self.add_update(changed)
+
+
+@dataclass(slots=True)
+class Estimate:
+    # Delta counts scaled up from a sample of the table, each given as
+    # (estimate, low, high) with a ~95% interval. rows1 and rows2 are exact.
+    table: str
+    rows1: int
+    rows2: int
+    rate: float
+    inserted: tuple[int, int, int]
+    deleted: tuple[int, int, int]
+    updated: tuple[int, int, int]
+    unchanged: tuple[int, int, int]
+
+    @property
+    def change_rate(self) -> float:
+        # the changed fraction of the distinct rows on either side (capped,
+        # as the scaled deletes and updates may add up to more than rows1)
+        changed = self.inserted[0] + self.deleted[0] + self.updated[0]
+        return min(changed / max(self.rows1 + self.inserted[0], 1), 1.0)
+
+
+CACHE_SIZE_KIB = 64 * 1024
+BATCH_SIZE = 10_000
+CHUNK_SIZE = 1000
+
+
+class Profile:
+    # Wall-clock time per phase and event counters, collected only when
+    # --profile is given. Worker processes return theirs for merging.
+    PHASES = ['reflect', 'fetch', 'exact', 'index', 'score', 'output']
+
+    def __init__(self):
+        self.enabled = False
+        self.times: dict[str, float] = defaultdict(float)
+        self.counts: Counter = Counter()
+
+    @contextmanager
+    def phase(self, name: str):
+        if not self.enabled:
+            yield
+            return
+        t0 = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.times[name] += time.perf_counter() - t0
+
+    def count(self, name: str, n: int = 1):
+        if self.enabled:
+            self.counts[name] += n
+
+    def deltas(self, deltas: Iterable) -> Iterator:
+        # Counts deltas by type and books the consumer's time between them
+        # (formatting and writing) as output, excluding the time spent
+        # producing the next delta upstream.
+        it = iter(deltas)
+        while True:
+            try:
+                d = next(it)
+            except StopIteration:
+                return
+            self.counts[f'deltas_{type(d).__name__.lower()}'] += 1
+            t0 = time.perf_counter()
+            yield d
+            self.times['output'] += time.perf_counter() - t0
+
+    def as_dict(self) -> dict:
+        return {'times': dict(self.times), 'counts': dict(self.counts)}
+
+    def merge(self, other: dict):
+        for name, t in other['times'].items():
+            self.times[name] += t
+        self.counts.update(other['counts'])
+
+    def reset(self, enabled: bool = False):
+        self.enabled = enabled
+        self.times.clear()
+        self.counts.clear()
+
+    def report(self, out: TextIO):
+        total = self.times.get('total', 0)
+        print('phase          seconds      %', file=out)
+        for name in self.PHASES + ['total']:
+            t = self.times.get(name, 0)
+            pct = 100 * t / total if total else 0
+            print(f'{name:<12}{t:>10.3f}{pct:>7.1f}', file=out)
+        for name, n in sorted(self.counts.items()):
+            print(f'{name:<20}{n:>12,}', file=out)
+
+
+PROFILE = Profile()
+
+
+@contextmanager
+def profiling(profile: bool | str):
+    # --profile prints the breakdown to stderr; --profile=PATH writes JSON
+    if not profile:
+        yield
+        return
+    PROFILE.reset(True)
+    t0 = time.perf_counter()
+    try:
+        yield
+    finally:
+        PROFILE.times['total'] = time.perf_counter() - t0
+        if isinstance(profile, str):
+            with open(profile, 'w') as f:
+                json.dump(PROFILE.as_dict(), f, indent=2)
+        else:
+            PROFILE.report(sys.stderr)
+
+
+def readonly_uri(path: str) -> str:
+    # immutable=1 lets SQLite skip locking and change detection entirely;
+    # diff inputs must not be modified while the diff runs
+    return f'file:{urlquote(os.path.abspath(path))}?mode=ro&immutable=1'
+
+
+def readonly_pragmas(mmap_size: int) -> list[str]:
+    return [f'PRAGMA mmap_size = {mmap_size}',
+            f'PRAGMA cache_size = -{CACHE_SIZE_KIB}',
+            'PRAGMA query_only = 1']
+
+
+def tune_readonly(engine: 'sqlalchemy.engine.Engine', mmap_size: int):
+    from sqlalchemy import event
+
+    @event.listens_for(engine, 'connect')
+    def set_pragmas(dbapi_conn, _record):
+        cur = dbapi_conn.cursor()
+        for pragma in readonly_pragmas(mmap_size):
+            cur.execute(pragma)
+        cur.close()
+
+
+# Reflected metadata shared by every DB opened on the same unmodified file
+_reflection_cache: dict[tuple, 'sqlalchemy.MetaData'] = {}
 
 
 class DB:
-    def __init__(self, path):
-        url = f'sqlite:///{path}'
-        engine = sqlalchemy.create_engine(url)
-        self.conn = engine.connect()
-        self.meta = sqlalchemy.MetaData()
-        self.meta.reflect(engine)
-
-    def get_all(self, table: str,
+    # recorded with fingerprints, as the backends return different types
+    # for the same values
+    backend = 'sqlalchemy'
+
+    def __init__(self, path, readonly = True):
+        import sqlalchemy
+        self.path = path
+        self.readonly = readonly
+        st = os.stat(path)
+        if readonly:
+            url = f'sqlite:///{readonly_uri(path)}&uri=true'
+            self.engine = sqlalchemy.create_engine(url)
+            tune_readonly(self.engine, st.st_size)
+        else:
+            url = f'sqlite:///{path}'
+            self.engine = sqlalchemy.create_engine(url)
+        self.conn = self.engine.connect()
+        self.cache_key = (os.path.realpath(path), st.st_mtime_ns,
+                          st.st_size)
+        self.meta = _reflection_cache.setdefault(self.cache_key,
+                                                 sqlalchemy.MetaData())
+        self.attached: dict[str, str] = {}
+
+    def table(self, name: str) -> 'sqlalchemy.Table':
+        if name not in self.meta.tables:
+            with PROFILE.phase('reflect'):
+                self.meta.reflect(self.engine, only=[name])
+        return self.meta.tables[name]
+
+    def foreign_keys(self, table: str) -> list[tuple[str, str, str]]:
+        # (column, referenced table, referenced column)
+        return [(fk.parent.name, fk.column.table.name, fk.column.name)
+                for fk in self.table(table).foreign_keys]
+
+    def table_names(self) -> list[str]:
+        import sqlalchemy
+        return sqlalchemy.inspect(self.engine).get_table_names()
+
+    def columns(self, table: str,
                 exclude_cols: list | None = None) -> list:
-        cols = list(self.meta.tables[table].columns)
+        cols = list(self.table(table).columns)
         if exclude_cols:
             cols = [c for c in cols
                     if c.name not in exclude_cols]
+        return cols
+
+    def stream(self, query, batch_size: int = BATCH_SIZE) -> Iterator[tuple]:
+        conn = self.conn.execution_options(stream_results=True)
+        with PROFILE.phase('fetch'):
+            result = conn.execute(query)
+        while True:
+            with PROFILE.phase('fetch'):
+                batch = [tuple(row) for row in result.fetchmany(batch_size)]
+            if not batch:
+                break
+            PROFILE.count('rows_fetched', len(batch))
+            yield from batch
+
+    def iter_rows(self, table: str, exclude_cols: list | None = None,
+                  batch_size: int = BATCH_SIZE, with_rowid: bool = False,
+                  where: str | None = None) -> Iterator[tuple]:
+        from sqlalchemy import literal_column, select, text
+        cols = self.columns(table, exclude_cols)
+        if with_rowid:
+            cols = [literal_column('rowid')] + cols
+        query = select(*cols).select_from(self.table(table))
+        if where:
+            query = query.where(text(where))
+        return self.stream(query, batch_size)
+
+    def get_by_rowid(self, table: str, rowids: list[int],
+                     exclude_cols: list | None = None) -> list[tuple]:
+        from sqlalchemy import literal_column, select
+        cols = self.columns(table, exclude_cols)
+        rowid = literal_column('rowid')
+        rows = []
+        # stay under SQLite's bound-parameter limit
+        for i in range(0, len(rowids), 900):
+            query = (select(*cols).select_from(self.table(table))
+                     .where(rowid.in_(rowids[i:i + 900]))
+                     .order_by(rowid))
+            rows.extend(self.stream(query))
+        return rows
+
+    def get_all(self, table: str, exclude_cols: list | None = None,
+                where: str | None = None) -> list[tuple]:
+        return list(self.iter_rows(table, exclude_cols, where=where))
+
+    def common_tables(self, other: 'DB') -> list[str]:
+        other_names = set(other.table_names())
+        return [t for t in self.table_names() if t in other_names]
+
+    def attach(self, path: str) -> str:
+        from sqlalchemy import text
+        if path not in self.attached:
+            alias = f'other{len(self.attached)}'
+            target = readonly_uri(path) if self.readonly else path
+            self.conn.execute(text(f'ATTACH DATABASE :path AS {alias}'),
+                              {'path': target})
+            self.attached[path] = alias
+        return self.attached[path]
+
+    def residual_rows(self, table: str, other_path: str,
+                      exclude_cols: list | None = None,
+                      where: str | None = None) -> tuple[list, list]:
+        # Multiset difference in both directions, computed by SQLite. Rows
+        # are numbered within each group of duplicates so that EXCEPT pairs
+        # them off one-for-one like split_exact() does.
+        from sqlalchemy import text
+        other = self.attach(other_path)
+        quote = self.conn.dialect.identifier_preparer.quote
+        cols = ', '.join(quote(c.name)
+                         for c in self.columns(table, exclude_cols))
+        tbl = quote(table)
+        cond = f' WHERE {where}' if where else ''
+
+        def numbered(schema):
+            return (f'SELECT {cols}, ROW_NUMBER() OVER (PARTITION BY {cols})'
+                    f' AS _rn FROM {schema}.{tbl}{cond}')
+
+        def except_rows(a, b):
+            query = text(f'SELECT {cols} FROM'
+                         f' ({numbered(a)} EXCEPT {numbered(b)})')
+            return list(self.stream(query))
+
+        return except_rows('main', other), except_rows(other, 'main')
+
+    def iter_sorted(self, table: str, key: list[str],
+                    exclude_cols: list | None = None,
+                    batch_size: int = BATCH_SIZE,
+                    where: str | None = None) -> Iterator[tuple]:
+        from sqlalchemy import select, text
+        cols = self.columns(table, exclude_cols)
+        by_name = {c.name: c for c in cols}
+        missing = [k for k in key if k not in by_name]
+        if missing:
+            raise ValueError(f'key columns not selected: {missing}')
+
+        # BINARY whatever the declared collation, to match sqlite_order()
+        query = select(*cols).order_by(*[by_name[k].collate('BINARY')
+                                         for k in key])
+        if where:
+            query = query.where(text(where))
+        return self.stream(query, batch_size)
+
+
+class LiteType(str):
+    # a declared column type, with the python_type SQLAlchemy types offer
+    @property
+    def python_type(self) -> type:
+        types = {'integer': int, 'real': float, 'text': str, 'blob': bytes}
+        if (typ := types.get(affinity(self))) is None:
+            raise NotImplementedError
+        return typ
+
+
+@dataclass(slots=True, frozen=True)
+class LiteColumn:
+    name: str
+    type: LiteType
+
+
+def quote_ident(name: str) -> str:
+    return '"' + name.replace('"', '""') + '"'
+
+
+class LiteDB(DB):
+    # DB on the plain sqlite3 module, for --lite: no SQLAlchemy import and
+    # no reflection beyond PRAGMA table_info. Values come back exactly as
+    # SQLite stores them, whereas SQLAlchemy converts e.g. NUMERIC columns
+    # to Decimal. Every mode but --engine=sqlite is supported.
+    backend = 'sqlite3'
+
+    def __init__(self, path, readonly = True):
+        import sqlite3
+        self.path = path
+        self.readonly = readonly
+        if readonly:
+            self.conn = sqlite3.connect(readonly_uri(path), uri=True)
+            for pragma in readonly_pragmas(os.stat(path).st_size):
+                self.conn.execute(pragma)
+        else:
+            self.conn = sqlite3.connect(path)
+        self.cols: dict[str, list[LiteColumn]] = {}
+
+    def foreign_keys(self, table: str) -> list[tuple[str, str, str]]:
+        query = f'PRAGMA foreign_key_list({quote_ident(table)})'
+        return [(r[3], r[2], r[4]) for r in self.conn.execute(query)]
+
+    def table_names(self) -> list[str]:
+        query = ("SELECT name FROM sqlite_master WHERE type = 'table' "
+                 "AND name NOT LIKE 'sqlite_%' ORDER BY name")
+        return [name for name, in self.conn.execute(query)]
+
+    def columns(self, table: str,
+                exclude_cols: list | None = None) -> list:
+        if table not in self.cols:
+            with PROFILE.phase('reflect'):
+                info = self.conn.execute(
+                    f'PRAGMA table_info({quote_ident(table)})').fetchall()
+            if not info:
+                raise ValueError(f'no such table: {table}')
+            self.cols[table] = [LiteColumn(r[1], LiteType(r[2]))
+                                for r in info]
+        cols = self.cols[table]
+        if exclude_cols:
+            cols = [c for c in cols if c.name not in exclude_cols]
+        return cols
+
+    def stream(self, query: str, batch_size: int = BATCH_SIZE,
+               params: tuple = ()) -> Iterator[tuple]:
+        with PROFILE.phase('fetch'):
+            cur = self.conn.execute(query, params)
+        while True:
+            with PROFILE.phase('fetch'):
+                batch = cur.fetchmany(batch_size)
+            if not batch:
+                break
+            PROFILE.count('rows_fetched', len(batch))
+            yield from batch
+
+    def select(self, table: str, exclude_cols: list | None,
+               with_rowid: bool = False) -> str:
+        names = [quote_ident(c.name)
+                 for c in self.columns(table, exclude_cols)]
+        if with_rowid:
+            names.insert(0, 'rowid')
+        return f'SELECT {", ".join(names)} FROM {quote_ident(table)}'
+
+    def iter_rows(self, table: str, exclude_cols: list | None = None,
+                  batch_size: int = BATCH_SIZE, with_rowid: bool = False,
+                  where: str | None = None) -> Iterator[tuple]:
+        query = self.select(table, exclude_cols, with_rowid)
+        if where:
+            query += f' WHERE {where}'
+        return self.stream(query, batch_size)
+
+    def get_by_rowid(self, table: str, rowids: list[int],
+                     exclude_cols: list | None = None) -> list[tuple]:
+        query = self.select(table, exclude_cols)
+        rows = []
+        for i in range(0, len(rowids), 900):
+            chunk = tuple(rowids[i:i + 900])
+            marks = ', '.join('?' * len(chunk))
+            rows.extend(self.stream(
+                f'{query} WHERE rowid IN ({marks}) ORDER BY rowid',
+                params=chunk))
+        return rows
+
+    def attach(self, path: str) -> str:
+        raise ValueError('--engine=sqlite is not supported with --lite')
+
+    def iter_sorted(self, table: str, key: list[str],
+                    exclude_cols: list | None = None,
+                    batch_size: int = BATCH_SIZE,
+                    where: str | None = None) -> Iterator[tuple]:
+        names = [c.name for c in self.columns(table, exclude_cols)]
+        missing = [k for k in key if k not in names]
+        if missing:
+            raise ValueError(f'key columns not selected: {missing}')
 
-        query = select(*cols)
-        return self.conn.execute(query).fetchall()
+        query = self.select(table, exclude_cols)
+        if where:
+            query += f' WHERE {where}'
+        query += ' ORDER BY ' + ', '.join(f'{quote_ident(k)} COLLATE BINARY'
+                                          for k in key)
+        return self.stream(query, batch_size)
+
+
+def fingerprint(row: tuple) -> int:
+    digest = hashlib.blake2b(repr(row).encode(), digest_size=8).digest()
+    return int.from_bytes(digest, 'little')
+
+
+def file_digest(path: str) -> str:
+    h = hashlib.blake2b(digest_size=16)
+    with open(path, 'rb') as f:
+        while chunk := f.read(1 << 20):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+def default_cache_dir() -> str:
+    base = os.environ.get('XDG_CACHE_HOME') or os.path.expanduser('~/.cache')
+    return os.path.join(base, 'pdgapi-diff')
+
+
+def scan_fingerprints(db: DB, table: str, exclude_cols: list | None = None,
+                      where: str | None = None) -> tuple[array, array]:
+    rowids, fps = array('q'), array('Q')
+    for rowid, *vals in db.iter_rows(table, exclude_cols, with_rowid=True,
+                                     where=where):
+        rowids.append(rowid)
+        fps.append(fingerprint(tuple(vals)))
+    return rowids, fps
+
+
+class FingerprintCache:
+    # One file per (database contents, backend, table, exclude_cols,
+    # where): a row count followed by the rowids (int64) and row
+    # fingerprints (uint64), loaded back with mmap so repeat runs never
+    # rescan the table.
+    def __init__(self, cache_dir: str | None = None):
+        self.cache_dir = cache_dir or default_cache_dir()
+
+    def path_for(self, db: DB, table: str, exclude_cols: list | None,
+                 where: str | None = None) -> str:
+        key = (db.backend, table, sorted(exclude_cols or []))
+        key = repr(key + (where,) if where else key)
+        key_hash = hashlib.blake2b(key.encode(), digest_size=8).hexdigest()
+        return os.path.join(self.cache_dir,
+                            f'{file_digest(db.path)}-{key_hash}.fp')
+
+    def build(self, db: DB, table: str, exclude_cols: list | None,
+              path: str, where: str | None = None):
+        rowids, fps = scan_fingerprints(db, table, exclude_cols, where)
+        os.makedirs(self.cache_dir, exist_ok=True)
+        tmp = f'{path}.{os.getpid()}.tmp'
+        with open(tmp, 'wb') as f:
+            array('Q', [len(rowids)]).tofile(f)
+            rowids.tofile(f)
+            fps.tofile(f)
+        os.replace(tmp, path)
+
+    def load(self, db: DB, table: str, exclude_cols: list | None = None,
+             where: str | None = None) -> tuple[memoryview, memoryview]:
+        path = self.path_for(db, table, exclude_cols, where)
+        if not os.path.exists(path):
+            self.build(db, table, exclude_cols, path, where)
+
+        with open(path, 'rb') as f:
+            buf = memoryview(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+        n = buf[:8].cast('Q')[0]
+        rowids = buf[8:8 + 8 * n].cast('q')
+        fps = buf[8 + 8 * n:8 + 16 * n].cast('Q')
+        return rowids, fps
+
+
+def cached_residual_rows(db1: DB, db2: DB, table: str,
+                         exclude_cols: list | None = None,
+                         cache_dir: str | None = None,
+                         where: str | None = None) -> tuple[list, list]:
+    # split_exact() over fingerprints; only the rows left over on each side
+    # are fetched from SQLite
+    cache = FingerprintCache(cache_dir)
+    rowids1, fps1 = cache.load(db1, table, exclude_cols, where)
+    rowids2, fps2 = cache.load(db2, table, exclude_cols, where)
+
+    unmatched = Counter(fps2)
+    residual1 = []
+    for rowid, fp in zip(rowids1, fps1):
+        if unmatched[fp]:
+            unmatched[fp] -= 1
+        else:
+            residual1.append(rowid)
+
+    residual2 = []
+    for rowid, fp in zip(rowids2, fps2):
+        if unmatched[fp]:
+            unmatched[fp] -= 1
+            residual2.append(rowid)
+
+    return (db1.get_by_rowid(table, residual1, exclude_cols),
+            db2.get_by_rowid(table, residual2, exclude_cols))
+
+
+# Rough in-memory size of one pending (fingerprint, rowid) entry of a run,
+# used to size the runs from --memory_limit
+SPILL_ENTRY_BYTES = 64
+
+
+def spill_runs(db: DB, table: str, exclude_cols: list | None,
+               run_rows: int, prefix: str,
+               where: str | None = None) -> list[str]:
+    # Sorted runs of (fingerprint, rowid) pairs, each at most run_rows long,
+    # written as interleaved 64-bit ints. The pair is packed into one int so
+    # that a run sorts as a flat list.
+    paths = []
+
+    def flush(buf):
+        with PROFILE.phase('exact'):
+            buf.sort()
+            run = array('Q')
+            for packed in buf:
+                run.extend((packed >> 64, packed & (2**64 - 1)))
+            path = f'{prefix}{len(paths)}.run'
+            with open(path, 'wb') as f:
+                run.tofile(f)
+            paths.append(path)
+
+    buf = []
+    for rowid, *vals in db.iter_rows(table, exclude_cols, with_rowid=True,
+                                     where=where):
+        buf.append(fingerprint(tuple(vals)) << 64 | rowid & (2**64 - 1))
+        if len(buf) >= run_rows:
+            flush(buf)
+            buf = []
+    if buf:
+        flush(buf)
+    return paths
+
+
+def read_run(path: str) -> Iterator[tuple[int, int]]:
+    with open(path, 'rb') as f:
+        if not os.fstat(f.fileno()).st_size:
+            return
+        buf = memoryview(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+    # rowids are stored two's complement, so read them back signed
+    yield from zip(buf.cast('Q')[0::2], buf.cast('q')[1::2])
+
+
+def external_residual_rows(db1: DB, db2: DB, table: str,
+                           exclude_cols: list | None = None,
+                           memory_limit: int = 1024,
+                           where: str | None = None) -> tuple[list, list]:
+    # Out-of-core split_exact(): both tables are spilled to sorted runs of
+    # fingerprints and merged, so only the rows without an exact partner are
+    # ever loaded. memory_limit (MiB) bounds the runs, not the residual.
+    run_rows = max(1, memory_limit * 2**20 // 2 // SPILL_ENTRY_BYTES)
+    import tempfile
+    with tempfile.TemporaryDirectory(prefix='pdgapi-diff-') as tmpdir:
+        runs1 = spill_runs(db1, table, exclude_cols, run_rows,
+                           os.path.join(tmpdir, 'a'), where)
+        runs2 = spill_runs(db2, table, exclude_cols, run_rows,
+                           os.path.join(tmpdir, 'b'), where)
+
+        def groups(runs):
+            merged = heapq.merge(*(read_run(p) for p in runs))
+            for fp, grp in groupby(merged, lambda e: e[0]):
+                yield fp, [rowid for _, rowid in grp]
+
+        residual1, residual2 = array('q'), array('q')
+        with PROFILE.phase('exact'):
+            groups1, groups2 = groups(runs1), groups(runs2)
+            g1, g2 = next(groups1, None), next(groups2, None)
+            while g1 or g2:
+                if g2 is None or (g1 is not None and g1[0] < g2[0]):
+                    residual1.extend(g1[1])
+                    g1 = next(groups1, None)
+                elif g1 is None or g2[0] < g1[0]:
+                    residual2.extend(g2[1])
+                    g2 = next(groups2, None)
+                else:
+                    n = min(len(g1[1]), len(g2[1]))
+                    residual1.extend(g1[1][n:])
+                    residual2.extend(g2[1][n:])
+                    g1, g2 = next(groups1, None), next(groups2, None)
+
+    return (db1.get_by_rowid(table, sorted(residual1), exclude_cols),
+            db2.get_by_rowid(table, sorted(residual2), exclude_cols))
+
+
+@dataclass
+class DiffState:
+    # Outcome of diffing a fixed baseline against one candidate: every
+    # candidate row's fingerprint and the baseline rowid it was paired with
+    # (-1 for an Insert), and whether that pair was identical. Baseline rows
+    # paired with no candidate row were Deletes.
+    baseline_digest: str
+    table: str
+    exclude_cols: list
+    baseline_rowids: list[int]
+    fps: list[int]
+    partners: list[int]
+    exact: list[bool]
+    backend: str = DB.backend
+
+    @classmethod
+    def identity(cls, db: DB, table: str, exclude_cols: list | None,
+                 rowids: Iterable[int], fps: Iterable[int]) -> 'DiffState':
+        # the baseline diffed against itself: every row paired exactly
+        rowids = list(rowids)
+        return cls(file_digest(db.path), table, list(exclude_cols or []),
+                   rowids, list(fps), list(rowids), [True] * len(rowids),
+                   db.backend)
+
+    @classmethod
+    def load(cls, path: str) -> 'DiffState':
+        with open(path) as f:
+            return cls(**json.load(f))
+
+    def save(self, path: str):
+        tmp = f'{path}.{os.getpid()}.tmp'
+        with open(tmp, 'w') as f:
+            json.dump(asdict(self), f)
+        os.replace(tmp, path)
+
+    def check(self, db: DB, table: str, exclude_cols: list | None):
+        if (self.table, self.exclude_cols) != (table,
+                                               list(exclude_cols or [])):
+            raise ValueError(f'state is for table {self.table!r} with '
+                             f'exclude_cols={self.exclude_cols}')
+        if self.baseline_digest != file_digest(db.path):
+            raise ValueError(f'state was saved against a different '
+                             f'baseline than {db.path}')
+        if self.backend != db.backend:
+            raise ValueError(f'state was saved by the {self.backend} '
+                             f'backend; give --lite on every run or none')
+
+
+def incremental_diff(db1: DB, db2: DB, table: str, state: DiffState | None,
+                     max_dist = 1, exclude_cols = ['id'],
+                     matcher = 'blocking', progress = True, jobs = 1,
+                     cache = False, cache_dir = None, pairing = 'greedy'
+                     ) -> tuple[list[Delta], DiffState]:
+    # Candidate rows whose fingerprint was already in the saved state keep
+    # their old pairing. Only rows without a partner on either side (new
+    # fingerprints, old Inserts and Deletes, baseline rows whose partner
+    # changed) go through the fuzzy matcher.
+    def fingerprints(db):
+        if cache:
+            return FingerprintCache(cache_dir).load(db, table, exclude_cols)
+        return scan_fingerprints(db, table, exclude_cols)
+
+    if state is None:
+        state = DiffState.identity(db1, table, exclude_cols,
+                                   *fingerprints(db1))
+    else:
+        state.check(db1, table, exclude_cols)
+    rowids2, fps2 = fingerprints(db2)
+
+    old = defaultdict(list)
+    for k in reversed(range(len(state.fps))):
+        old[state.fps[k]].append(k)
+
+    # previous Inserts stay candidates, as they may pair with a baseline
+    # row whose old partner is gone
+    partners, exact = [-1] * len(fps2), [False] * len(fps2)
+    residual2 = []
+    for j, fp in enumerate(fps2):
+        if old[fp]:
+            k = old[fp].pop()
+            partners[j], exact[j] = state.partners[k], state.exact[k]
+        if partners[j] < 0:
+            residual2.append(j)
+
+    taken = {x for x in partners if x >= 0}
+    residual1 = [x for x in state.baseline_rowids if x not in taken]
+
+    rows1 = db1.get_by_rowid(table, residual1, exclude_cols)
+    rows2 = db2.get_by_rowid(table, [rowids2[j] for j in residual2],
+                             exclude_cols)
+    # identical rows pair first, as in compare(), so restored duplicates
+    # never reach the fuzzy matcher
+    pairs = pair_rows(rows1, rows2, max_dist, matcher, jobs, pairing,
+                      progress)
+    for i, j in pairs:
+        partners[residual2[j]] = residual1[i]
+        exact[residual2[j]] = rows1[i] == rows2[j]
+
+    # fetch the rows behind every reported delta, new or carried over
+    show1 = sorted({x for x, e in zip(partners, exact) if x >= 0 and not e}
+                   | (set(residual1) - set(partners)))
+    show2 = [rowids2[j] for j, e in enumerate(exact) if not e]
+    vals1 = dict(zip(show1, db1.get_by_rowid(table, show1, exclude_cols)))
+    vals2 = dict(zip(show2, db2.get_by_rowid(table, show2, exclude_cols)))
+
+    by_partner = {x: rowids2[j] for j, x in enumerate(partners)
+                  if x >= 0 and not exact[j]}
+    deltas: list[Delta] = []
+    for x in show1:
+        if x in by_partner:
+            old_row, new_row = vals1[x], vals2[by_partner[x]]
+            deltas.append(Update(old_row, new_row,
+                                 changed_cols(old_row, new_row)))
+        else:
+            deltas.append(Delete(vals1[x]))
+    for j, x in enumerate(partners):
+        if x < 0:
+            deltas.append(Insert(vals2[rowids2[j]]))
+
+    new_state = DiffState(state.baseline_digest, table, state.exclude_cols,
+                          state.baseline_rowids, list(fps2), partners, exact,
+                          state.backend)
+    return deltas, new_state
+
+
+class Interner:
+    # Per-column dictionary shared by both sides of a table diff. Encoded
+    # rows are tuples of small ints, which hash and compare much faster
+    # than the original strings, and each distinct value is stored once.
+    # The codes are exact, so two rows differ in a column iff their codes
+    # do: the exact pre-pass, distance() and the changed-column mask of
+    # each Update all work on the codes alone.
+    def __init__(self):
+        self.codes: list[dict] = []
+        self.values: list[list] = []
+
+    def encode(self, rows: Iterable[tuple]) -> list[tuple]:
+        out = []
+        for row in rows:
+            while len(self.codes) < len(row):
+                self.codes.append({})
+                self.values.append([])
+            enc = []
+            for codes, values, v in zip(self.codes, self.values, row):
+                code = codes.get(v)
+                if code is None:
+                    code = codes[v] = len(values)
+                    values.append(v)
+                enc.append(code)
+            out.append(tuple(enc))
+        return out
+
+    def decode(self, row: tuple) -> tuple:
+        return tuple(values[c] for values, c in zip(self.values, row))
+
+    @contextmanager
+    def decoding(self):
+        # match errors name the original values, not their codes
+        try:
+            yield
+        except MatchError as e:
+            raise e.decoded(self.decode) from None
+
+    def decode_deltas(self, deltas: Iterable[Delta]) -> Iterator[Delta]:
+        with self.decoding():
+            for d in deltas:
+                match d:
+                    case Update(old_row, new_row, changed):
+                        yield Update(self.decode(old_row),
+                                     self.decode(new_row), changed)
+                    case _:
+                        yield type(d)(self.decode(d.row))
+
+    def compare(self, compare_fn, rows1: Iterable[tuple],
+                rows2: Iterable[tuple], *args) -> Iterator[Delta]:
+        rows1, rows2 = self.encode(rows1), self.encode(rows2)
+        return self.decode_deltas(compare_fn(rows1, rows2, *args))
+
+
+def affinity(type_name: str) -> str:
+    # SQLite's column affinity rules for a declared type
+    name = type_name.upper()
+    if 'INT' in name:
+        return 'integer'
+    if any(s in name for s in ('CHAR', 'CLOB', 'TEXT')):
+        return 'text'
+    if 'BLOB' in name or not name:
+        return 'blob'
+    if any(s in name for s in ('REAL', 'FLOA', 'DOUB')):
+        return 'real'
+    return 'numeric'
+
+
+RULES = ('tolerance', 'ignore_case', 'ignore_space', 'null_empty', 'remaps')
+
+
+class Comparator:
+    # Per-column comparison rules compiled into a single function that maps
+    # a row to its canonical form. Rows are canonicalised once, so the exact
+    # pre-pass, the matchers and distance() all see rows that are equal
+    # under the rules without any per-value checks in their inner loops.
+    # Numeric tolerance snaps REAL/NUMERIC values (Decimal included) to a
+    # grid of that width, which unlike a pairwise |a - b| <= tol test can
+    # be hashed: values either side of a grid line still differ, however
+    # close. Infinities and NaN are left as they are.
+    # remaps rewrites the old side's foreign keys to the new side's ids;
+    # old ids without a partner become (id,), which equals no new id.
+    def __init__(self, columns: list, skip: Iterable[str] = (),
+                 tolerance: float | None = None, ignore_case = False,
+                 ignore_space = False, null_empty = False,
+                 remaps: dict[str, dict] | None = None):
+        exprs1, exprs2 = [], []
+        scope = {'_num': (int, float, Decimal)}
+        for i, col in enumerate(columns):
+            v, expr = f'c{i}', f'c{i}'
+            kind = affinity(str(col.type))
+            if col.name in skip:
+                pass
+            elif kind in ('real', 'numeric') and tolerance:
+                expr = (f'(round(_x) if {v}.__class__ in _num and '
+                        f'(_x := float({v}) * {1 / tolerance!r}) - _x == 0 '
+                        f'else {v})')
+            elif kind == 'text':
+                norm = v
+                if ignore_space:
+                    norm = f"' '.join({norm}.split())"
+                if ignore_case:
+                    norm = f'{norm}.casefold()'
+                if norm != v:
+                    expr = f'({norm} if {v}.__class__ is str else {v})'
+                if null_empty:
+                    expr = f"('' if {v} is None else {expr})"
+            exprs2.append(expr)
+
+            if remaps and col.name in remaps and col.name not in skip:
+                scope[f'_m{i}'] = remaps[col.name]
+                expr = f'(None if {v} is None else _m{i}.get({v}, ({v},)))'
+            exprs1.append(expr)
+
+        self.active = exprs1 != [f'c{i}' for i in range(len(columns))]
+        names = ''.join(f'c{i}, ' for i in range(len(columns))) or '() '
+        for name, exprs in (('canon1', exprs1), ('canon2', exprs2)):
+            exec(f'def {name}(row):\n'
+                 f'    {names}= row\n'
+                 f'    return ({"".join(e + ", " for e in exprs)})\n', scope)
+        self.canon1, self.canon2 = scope['canon1'], scope['canon2']
+
+    @classmethod
+    def for_table(cls, db: 'DB', table: str, exclude_cols: list | None,
+                  key = None, **rules) -> 'Comparator | None':
+        # key columns are left alone, as the merge-join relies on their
+        # SQL ordering
+        comparator = cls(db.columns(table, exclude_cols),
+                         as_list(key) if key else (), **rules)
+        return comparator if comparator.active else None
+
+    def canonical(self, rows1: Iterable[tuple],
+                  rows2: Iterable[tuple]) -> tuple[list, list]:
+        return ([self.canon1(row) for row in rows1],
+                [self.canon2(row) for row in rows2])
+
+    def compare(self, compare_fn, rows1: Iterable[tuple],
+                rows2: Iterable[tuple], *args) -> Iterator[Delta]:
+        # compare_fn sees canonical rows; the deltas are mapped back to the
+        # original rows they came from
+        orig1, orig2 = defaultdict(list), defaultdict(list)
+        canon1, canon2 = [], []
+        for rows, canon, orig, out in ((rows1, self.canon1, orig1, canon1),
+                                       (rows2, self.canon2, orig2, canon2)):
+            for row in rows:
+                c = canon(row)
+                orig[c].append(row)
+                out.append(c)
+
+        for d in compare_fn(canon1, canon2, *args):
+            match d:
+                case Update(old_row, new_row, changed):
+                    yield Update(orig1[old_row].pop(), orig2[new_row].pop(),
+                                 changed)
+                case Delete(row):
+                    yield Delete(orig1[row].pop())
+                case Insert(row):
+                    yield Insert(orig2[row].pop())
 
 
 def distance(vals1: tuple, vals2: tuple):
@@ -55,71 +969,1315 @@ def distance(vals1: tuple, vals2: tuple):
     return sum(v1 != v2 for v1, v2 in zip(vals1, vals2))
 
 
-def find_nearest(needle: tuple, haystack: list[tuple],
-                 max_dist: int) -> tuple | None:
-    dists = [distance(needle, straw) for straw in haystack]
-    min_dist = min(dists)
-    idcs = [i for i, d in enumerate(dists) if d == min_dist]
-    if min_dist > max_dist:
+class MatchError(AssertionError):
+    # Greedy pairing found no unique partner. The rows are kept apart from
+    # the message, so an Interner can re-raise it with them decoded.
+    def __init__(self, fmt: str, *rows):
+        super().__init__(fmt.format(*rows))
+        self.fmt, self.rows = fmt, rows
+
+    def decoded(self, decode) -> 'MatchError':
+        return MatchError(self.fmt, *(
+            [decode(r) for r in row] if isinstance(row, list)
+            else decode(row) for row in self.rows))
+
+
+def find_nearest(needle: tuple, links: dict[int, int],
+                 haystack: list[tuple]) -> int | None:
+    if not links:
         return None
-    assert len(idcs) == 1, \
-        f'ambiguous match: {needle} --> {[haystack[i] for i in idcs]}'
-    return haystack[idcs[0]]
+    min_dist = min(links.values())
+    idcs = [i for i, d in links.items() if d == min_dist]
+    if len(idcs) != 1:
+        raise MatchError('ambiguous match: {} --> {}', needle,
+                         [haystack[i] for i in idcs])
+    return idcs[0]
+
+
+class BruteForceIndex:
+    def __init__(self, rows: list[tuple], max_dist: int):
+        self.rows = rows
+        self.max_dist = max_dist
+        self.scored = 0
+
+    def candidates(self, needle: tuple) -> Iterable[int]:
+        return range(len(self.rows))
+
+    def scores(self, needle: tuple) -> Iterable[tuple[int, int]]:
+        candidates = self.candidates(needle)
+        self.scored += len(candidates)
+        for j in candidates:
+            d = distance(needle, self.rows[j])
+            if d <= self.max_dist:
+                yield j, d
+
+
+class BlockIndex(BruteForceIndex):
+    # Rows within max_dist of each other differ in at most max_dist columns,
+    # so by pigeonhole they agree on at least one of max_dist + 1 disjoint
+    # column groups. Only rows sharing a group key need to be scored.
+    def __init__(self, rows: list[tuple], max_dist: int):
+        super().__init__(rows, max_dist)
+        width = len(rows[0]) if rows else 0
+        n = max_dist + 1
+        self.bounds = [(g * width // n, (g + 1) * width // n)
+                       for g in range(n)]
+        self.buckets = defaultdict(list)
+        for i, row in enumerate(rows):
+            for key in self.keys(row):
+                self.buckets[key].append(i)
+
+    def keys(self, row: tuple) -> list[tuple]:
+        return [(g, row[lo:hi]) for g, (lo, hi) in enumerate(self.bounds)]
+
+    def candidates(self, needle: tuple) -> Iterable[int]:
+        idcs = set()
+        for key in self.keys(needle):
+            idcs.update(self.buckets.get(key, ()))
+        return sorted(idcs)
+
+
+class ColumnarIndex(BruteForceIndex):
+    # Every column is dictionary-encoded to int32 codes, so one needle is
+    # scored against all rows with a single vectorised comparison. Values
+    # absent from the haystack get code -1 and never match.
+    def __init__(self, rows: list[tuple], max_dist: int):
+        try:
+            import numpy as np
+        except ImportError:
+            raise ImportError('the columnar matcher requires numpy '
+                              '(pip install pdgapi-diff[columnar])')
+        super().__init__(rows, max_dist)
+        self.np = np
+        width = len(rows[0]) if rows else 0
+        self.dicts: list[dict] = [{} for _ in range(width)]
+        codes = [[d.setdefault(v, len(d)) for d, v in zip(self.dicts, row)]
+                 for row in rows]
+        self.codes = np.array(codes, dtype=np.int32).reshape(len(rows), width)
+
+    def scores(self, needle: tuple) -> Iterable[tuple[int, int]]:
+        np = self.np
+        code = np.array([d.get(v, -1) for d, v in zip(self.dicts, needle)],
+                        dtype=np.int32)
+        self.scored += len(self.rows)
+        dists = np.count_nonzero(self.codes != code, axis=1)
+        idcs = np.flatnonzero(dists <= self.max_dist)
+        return zip(idcs.tolist(), dists[idcs].tolist())
+
+
+MATCHERS = {
+    'blocking': BlockIndex,
+    'bruteforce': BruteForceIndex,
+    'columnar': ColumnarIndex,
+}
+
+
+MIN_SHARD_ROWS = 1000
+
+
+def score_shard(index: BruteForceIndex, needles: list[tuple],
+                start: int) -> tuple[list[tuple[int, int, int]], int]:
+    edges = []
+    scored = index.scored
+    for i, row in enumerate(needles, start):
+        edges.extend((i, j, d) for j, d in index.scores(row))
+    return edges, index.scored - scored
+
+
+_scorer: BruteForceIndex | None = None
+
+
+def _init_scorer(rows2: list[tuple], max_dist: int, matcher: str):
+    global _scorer
+    _scorer = MATCHERS[matcher](rows2, max_dist)
+
+
+def _score_worker(needles: list[tuple],
+                  start: int) -> tuple[list[tuple[int, int, int]], int]:
+    return score_shard(_scorer, needles, start)
+
+
+class DistanceGraph:
+    # Sparse bipartite graph of the (i, j) pairs with
+    # distance(rows1[i], rows2[j]) <= max_dist, scored once and then queried
+    # in both directions.
+    def __init__(self, rows1: list[tuple], rows2: list[tuple],
+                 max_dist: int, matcher: str = 'blocking',
+                 progress: bool = True, jobs: int | None = 1):
+        self.rows1, self.rows2 = rows1, rows2
+        self.fwd: list[dict[int, int]] = [{} for _ in rows1]
+        self.rev: list[dict[int, int]] = [{} for _ in rows2]
+
+        jobs = jobs or os.cpu_count()
+        n_shards = min(4 * jobs, len(rows1) // MIN_SHARD_ROWS)
+        if jobs > 1 and n_shards > 1:
+            # lazy: the workers build their indexes and score while the
+            # loop below consumes them, so all of it is timed as scoring
+            shards = self.score_parallel(matcher, max_dist, jobs, n_shards,
+                                         progress)
+        else:
+            with PROFILE.phase('index'):
+                index = MATCHERS[matcher](rows2, max_dist)
+            with PROFILE.phase('score'):
+                needles = rows1
+                if progress:
+                    from tqdm import tqdm
+                    needles = tqdm(rows1)
+                shards = [score_shard(index, needles, 0)]
+
+        with PROFILE.phase('score'):
+            for edges, scored in shards:
+                PROFILE.count('pairs_scored', scored)
+                for i, j, d in edges:
+                    self.fwd[i][j] = d
+                    self.rev[j][i] = d
+
+    def score_parallel(self, matcher: str, max_dist: int, jobs: int,
+                       n_shards: int, progress: bool):
+        # Shard the needles rather than the index: every shard scores
+        # against all of rows2, so no candidate pair can fall between shards,
+        # and the edges are merged back in needle order.
+        size = -(-len(self.rows1) // n_shards)
+        starts = range(0, len(self.rows1), size)
+        needles = [self.rows1[s:s + size] for s in starts]
+        from concurrent.futures import ProcessPoolExecutor
+        from tqdm import tqdm
+        # every worker builds its own index, so start no more than there
+        # are shards to score
+        with ProcessPoolExecutor(min(jobs, n_shards),
+                                 initializer=_init_scorer,
+                                 initargs=(self.rows2, max_dist,
+                                           matcher)) as pool:
+            results = pool.map(_score_worker, needles, starts)
+            yield from tqdm(results, total=len(needles),
+                            disable=not progress)
+
+    def nearest(self, i: int) -> int | None:
+        return find_nearest(self.rows1[i], self.fwd[i], self.rows2)
+
+    def reverse_nearest(self, j: int) -> int | None:
+        return find_nearest(self.rows2[j], self.rev[j], self.rows1)
+
+
+def split_exact(rows1: list[tuple],
+                rows2: list[tuple]) -> tuple[list[tuple], list[tuple]]:
+    with PROFILE.phase('exact'):
+        unmatched = Counter(rows2)
+        residual1 = []
+        for row in rows1:
+            if unmatched[row]:
+                unmatched[row] -= 1
+            else:
+                residual1.append(row)
+
+        residual2 = []
+        for row in rows2:
+            if unmatched[row]:
+                unmatched[row] -= 1
+                residual2.append(row)
+
+    PROFILE.count('exact_pruned', len(rows1) - len(residual1))
+    return residual1, residual2
+
+
+MAX_ASSIGNMENT_SIZE = 200
+
+
+def warn(msg: str):
+    from tqdm import tqdm
+    tqdm.write(msg, file=sys.stderr)
+
+
+def min_cost_assignment(cost: list[list[int]]) -> list[int]:
+    # Hungarian algorithm with potentials on a square matrix, O(n^3);
+    # returns the column assigned to each row
+    n = len(cost)
+    inf = float('inf')
+    u, v = [0] * (n + 1), [0] * (n + 1)
+    p, way = [0] * (n + 1), [0] * (n + 1)
+    for i in range(1, n + 1):
+        p[0] = i
+        j0 = 0
+        minv = [inf] * (n + 1)
+        used = [False] * (n + 1)
+        while True:
+            used[j0] = True
+            i0, delta, j1 = p[j0], inf, 0
+            row = cost[i0 - 1]
+            for j in range(1, n + 1):
+                if not used[j]:
+                    cur = row[j - 1] - u[i0] - v[j]
+                    if cur < minv[j]:
+                        minv[j], way[j] = cur, j0
+                    if minv[j] < delta:
+                        delta, j1 = minv[j], j
+            for j in range(n + 1):
+                if used[j]:
+                    u[p[j]] += delta
+                    v[j] -= delta
+                else:
+                    minv[j] -= delta
+            j0 = j1
+            if p[j0] == 0:
+                break
+        while j0:
+            j1 = way[j0]
+            p[j0] = p[j1]
+            j0 = j1
+
+    assigned = [0] * n
+    for j in range(1, n + 1):
+        assigned[p[j] - 1] = j - 1
+    return assigned
+
+
+def components(graph: 'DistanceGraph') -> Iterator[tuple[list, list]]:
+    seen1, seen2 = set(), set()
+    for start in range(len(graph.rows1)):
+        if start in seen1 or not graph.fwd[start]:
+            continue
+        comp1, comp2 = [start], []
+        seen1.add(start)
+        frontier = [start]
+        while frontier:
+            nxt = []
+            for i in frontier:
+                for j in graph.fwd[i]:
+                    if j not in seen2:
+                        seen2.add(j)
+                        comp2.append(j)
+                        for i2 in graph.rev[j]:
+                            if i2 not in seen1:
+                                seen1.add(i2)
+                                comp1.append(i2)
+                                nxt.append(i2)
+            frontier = nxt
+        yield sorted(comp1), sorted(comp2)
+
+
+def is_ambiguous(graph: 'DistanceGraph', comp1: list) -> bool:
+    # True where the greedy pairing would have hit a tie or an asymmetry
+    def nearest(links):
+        best = min(links.values())
+        idcs = [k for k, d in links.items() if d == best]
+        return idcs[0] if len(idcs) == 1 else None
+
+    for i in comp1:
+        j = nearest(graph.fwd[i])
+        if j is None or nearest(graph.rev[j]) != i:
+            return True
+    return False
+
+
+def assign_component(graph: 'DistanceGraph', comp1: list, comp2: list,
+                     max_dist: int) -> dict[int, int]:
+    if len(comp1) + len(comp2) > MAX_ASSIGNMENT_SIZE:
+        # too big for O(n^3): take the cheapest edges first instead
+        warn(f'cluster of {len(comp1)} old and {len(comp2)} new rows '
+             f'exceeds {MAX_ASSIGNMENT_SIZE}; paired cheapest edges first, '
+             f'which may not be a min-cost assignment')
+        edges = sorted((d, i, j) for i in comp1
+                       for j, d in graph.fwd[i].items())
+        pairs, taken = {}, set()
+        for d, i, j in edges:
+            if i not in pairs and j not in taken:
+                pairs[i] = j
+                taken.add(j)
+        return pairs
+
+    # Each side is padded with one dummy per row of the other side, so
+    # any row may stay unmatched at a cost above max_dist / 2; pairing two
+    # rows within max_dist is therefore always cheaper than a Delete plus
+    # an Insert.
+    n1, n2 = len(comp1), len(comp2)
+    n = n1 + n2
+    unmatched = max_dist + 1
+    big = 2 * n * unmatched + 1
+    cost = [[0] * n for _ in range(n)]
+    for a, i in enumerate(comp1):
+        links = graph.fwd[i]
+        row = cost[a]
+        for b, j in enumerate(comp2):
+            row[b] = 2 * links[j] if j in links else big
+        for b in range(n2, n):
+            row[b] = unmatched
+    for a in range(n1, n):
+        for b in range(n2):
+            cost[a][b] = unmatched
+
+    pairs = {}
+    for a, b in enumerate(min_cost_assignment(cost)[:n1]):
+        if b < n2 and comp2[b] in graph.fwd[comp1[a]]:
+            pairs[comp1[a]] = comp2[b]
+    return pairs
+
+
+def assign_pairs(graph: 'DistanceGraph',
+                 max_dist: int) -> Iterator[tuple[int, int | None]]:
+    # Global alternative to the greedy nearest-neighbour pairing: every
+    # connected component of the candidate graph is solved as a min-cost
+    # assignment. Components the greedy pairing would have rejected are
+    # reported rather than aborting the diff.
+    pairs = {}
+    for comp1, comp2 in components(graph):
+        if len(comp1) == len(comp2) == 1:
+            pairs[comp1[0]] = comp2[0]
+            continue
+        if is_ambiguous(graph, comp1):
+            # the rows may be interned here, so only their counts are shown
+            warn(f'ambiguous cluster of {len(comp1)} old and {len(comp2)} '
+                 f'new rows resolved by assignment')
+        pairs.update(assign_component(graph, comp1, comp2, max_dist))
+
+    for i in range(len(graph.rows1)):
+        yield i, pairs.get(i)
 
 
 def compare(rows1: list[tuple], rows2: list[tuple],
-            max_dist: int) -> list[Delta]:
-    deltas: list[Delta] = []
-    rows2_new = set(rows2)
+            max_dist: int, matcher: str = 'blocking',
+            progress: bool = True, jobs: int | None = 1,
+            pairing: str = 'greedy') -> Iterator[Delta]:
+    rows1, rows2 = split_exact(rows1, rows2)
+    return match_residual(rows1, rows2, max_dist, matcher, progress, jobs,
+                          pairing)
 
-    for row in tqdm(rows1):
-        nearest = find_nearest(row, rows2, max_dist)
-        if not nearest:
-            deltas.append(Delete(row))
+
+def iter_pairs(rows1: list[tuple], rows2: list[tuple],
+               max_dist: int, matcher: str = 'blocking',
+               progress: bool = True, jobs: int | None = 1,
+               pairing: str = 'greedy') -> Iterator[tuple[int, int | None]]:
+    graph = DistanceGraph(rows1, rows2, max_dist, matcher, progress, jobs)
+    if pairing == 'assignment':
+        yield from assign_pairs(graph, max_dist)
+        return
+    if pairing != 'greedy':
+        raise ValueError(f'unknown pairing: {pairing}')
+
+    for i, row in enumerate(rows1):
+        j = graph.nearest(i)
+        if j is not None:
+            reverse_i = graph.reverse_nearest(j)
+            if reverse_i != i:
+                raise MatchError('asymmetry: {} -> {} <- {}', row,
+                                 rows2[j], rows1[reverse_i])
+        yield i, j
+
+
+def match_residual(rows1: list[tuple], rows2: list[tuple],
+                   max_dist: int, matcher: str = 'blocking',
+                   progress: bool = True, jobs: int | None = 1,
+                   pairing: str = 'greedy') -> Iterator[Delta]:
+    # Deletes and Updates are yielded as soon as each row is decided;
+    # Inserts only once every row of rows1 has been paired
+    matched2 = set()
+    pairs = iter_pairs(rows1, rows2, max_dist, matcher, progress, jobs,
+                       pairing)
+    for i, j in pairs:
+        if j is None:
+            yield Delete(rows1[i])
         else:
-            reverse_nearest = find_nearest(nearest, rows1, max_dist)
-            assert reverse_nearest == row, \
-                f'asymmetry: {row} -> {nearest} <- {reverse_nearest}'
-            rows2_new.remove(nearest)
-            if nearest != row:
-                deltas.append(Update(row, nearest))
+            matched2.add(j)
+            if changed := changed_cols(rows1[i], rows2[j]):
+                yield Update(rows1[i], rows2[j], changed)
 
-    for row in rows2_new:
-        deltas.append(Insert(row))
+    for j, row in enumerate(rows2):
+        if j not in matched2:
+            yield Insert(row)
 
-    return deltas
 
+def sqlite_order(val):
+    # Python equivalent of SQLite's ORDER BY across storage classes:
+    # NULL < INTEGER/REAL < TEXT < BLOB, text compared as under BINARY
+    match val:
+        case None:
+            return (0, 0)
+        case int() | float() | Decimal():
+            return (1, val)
+        case str():
+            return (2, val)
+        case _:
+            return (3, val)
 
-def pprint(deltas: list[Delta]):
-    for d in deltas:
+
+def pair_rows(rows1: list[tuple], rows2: list[tuple], max_dist: int,
+              matcher: str = 'blocking', jobs: int | None = 1,
+              pairing: str = 'greedy',
+              progress: bool = False) -> Iterator[tuple[int, int]]:
+    # the (i, j) index pairs compare() would match, exact ones included;
+    # as in split_exact(), the last copies of a new row pair up exactly
+    # and the first stay in the residual
+    free = defaultdict(list)
+    for j, row in enumerate(rows2):
+        free[row].append(j)
+    left = []
+    for i, row in enumerate(rows1):
+        if free[row]:
+            yield i, free[row].pop()
+        else:
+            left.append(i)
+    right = sorted(j for idcs in free.values() for j in idcs)
+
+    res1, res2 = [rows1[i] for i in left], [rows2[j] for j in right]
+    for a, b in iter_pairs(res1, res2, max_dist, matcher, progress, jobs,
+                           pairing):
+        if b is not None:
+            yield left[a], right[b]
+
+
+def merge_compare(rows1: Iterable[tuple], rows2: Iterable[tuple],
+                  key_idcs: list[int], max_dist: int,
+                  matcher: str = 'blocking', pairing: str = 'greedy',
+                  comparator: Comparator | None = None) -> Iterator[Delta]:
+    def groups(rows):
+        keyfunc = lambda r: tuple(sqlite_order(r[i]) for i in key_idcs)
+        for k, grp in groupby(rows, keyfunc):
+            yield k, list(grp)
+
+    groups1, groups2 = groups(rows1), groups(rows2)
+    g1, g2 = next(groups1, None), next(groups2, None)
+
+    while g1 or g2:
+        if g2 is None or (g1 is not None and g1[0] < g2[0]):
+            yield from (Delete(row) for row in g1[1])
+            g1 = next(groups1, None)
+        elif g1 is None or g2[0] < g1[0]:
+            yield from (Insert(row) for row in g2[1])
+            g2 = next(groups2, None)
+        elif comparator:
+            yield from comparator.compare(compare, g1[1], g2[1], max_dist,
+                                          matcher, False, 1, pairing)
+            g1, g2 = next(groups1, None), next(groups2, None)
+        else:
+            yield from compare(g1[1], g2[1], max_dist, matcher,
+                               progress=False, pairing=pairing)
+            g1, g2 = next(groups1, None), next(groups2, None)
+
+
+def as_list(val) -> list:
+    if isinstance(val, str):
+        return val.split(',')
+    return list(val)
+
+
+def only_columns(db: 'DB', table: str, columns) -> list[str]:
+    # the exclude_cols that leave just the listed columns compared
+    names = as_list(columns)
+    all_names = [c.name for c in db.columns(table)]
+    missing = [n for n in names if n not in all_names]
+    if missing:
+        raise ValueError(f'no such columns in {table}: {missing}')
+    return [n for n in all_names if n not in names]
+
+
+class Writer:
+    # Formats deltas in chunks and writes each chunk as one block. ANSI
+    # styling is only emitted when the output is a terminal. With
+    # background=True the writes happen on a separate thread, so a slow
+    # pipe or terminal doesn't stall matching and formatting.
+    def __init__(self, out: TextIO | None = None, color: bool | None = None,
+                 chunk_size: int = CHUNK_SIZE, background: bool = False):
+        self.out = out or sys.stdout
+        if color is None:
+            color = self.out.isatty()
+        if color:
+            from colorama import Fore, Style
+            self.green, self.red = Fore.GREEN, Fore.RED
+            self.yellow = Fore.YELLOW
+            self.bright, self.reset = Style.BRIGHT, Style.RESET_ALL
+        else:
+            self.green = self.red = self.yellow = ''
+            self.bright = self.reset = ''
+        self.chunk_size = chunk_size
+        self.close_out = False
+        self.buf: list[str] = []
+        self.queue: Queue | None = None
+        self.error: Exception | None = None
+        if background:
+            self.queue = Queue(maxsize=8)
+            self.thread = Thread(target=self._drain, daemon=True)
+            self.thread.start()
+
+    def _drain(self):
+        # After a failed write (e.g. a closed pipe) the queue is still
+        # emptied, so the producer never blocks on it; flush() and close()
+        # re-raise the error.
+        while (block := self.queue.get()) is not None:
+            if self.error is None:
+                try:
+                    self.out.write(block)
+                except Exception as e:
+                    self.error = e
+        if self.error is None:
+            try:
+                self.out.flush()
+            except Exception as e:
+                self.error = e
+
+    def format(self, d: Delta) -> str:
         match d:
             case Insert(row):
-                print(f'{Fore.GREEN}{row}{Style.RESET_ALL}')
+                return f'{self.green}{row}{self.reset}\n\n'
             case Delete(row):
-                print(f'{Fore.RED}{row}{Style.RESET_ALL}')
-            case Update(old_row, new_row):
-                changed = [v1 == v2 for v1, v2 in zip(old_row, new_row)]
-                def fmt(i, v):
-                    if changed[i]:
-                        return str(v)
+                return f'{self.red}{row}{self.reset}\n\n'
+            case Update(old_row, new_row, changed):
+                if changed is None:
+                    changed = changed_cols(old_row, new_row)
+                changed = set(changed)
+                bright, reset = self.bright, self.reset
+                old_strs, new_strs = [], []
+                for c, (v1, v2) in enumerate(zip(old_row, new_row)):
+                    if c not in changed:
+                        old_strs.append(str(v1))
+                        new_strs.append(str(v2))
                     else:
-                        return Style.BRIGHT + str(v) + Style.RESET_ALL
-                old_strs = [fmt(i, v) for i, v in enumerate(old_row)]
-                new_strs = [fmt(i, v) for i, v in enumerate(new_row)]
-                print('(' + ','.join(old_strs) + ')')
-                print('(' + ','.join(new_strs) + ')')
-        print()
+                        old_strs.append(f'{bright}{v1}{reset}')
+                        new_strs.append(f'{bright}{v2}{reset}')
+                return (f'({",".join(old_strs)})\n'
+                        f'({",".join(new_strs)})\n\n')
+
+    def write(self, text: str):
+        self.buf.append(text)
+        if len(self.buf) >= self.chunk_size:
+            self.flush()
+
+    def note(self, text: str):
+        self.write(f'{self.yellow}{text}{self.reset}\n')
+
+    def begin_table(self, table: str, columns: list, banner: bool = False):
+        if banner:
+            self.write(f'{self.bright}=== {table} ==={self.reset}\n')
+
+    def write_deltas(self, deltas: Iterable[Delta]):
+        if PROFILE.enabled:
+            deltas = PROFILE.deltas(deltas)
+        for d in deltas:
+            self.write(self.format(d))
+
+    def write_summary(self, summary: Summary):
+        unchanged = ('' if summary.unchanged is None
+                     else f', {summary.unchanged} unchanged')
+        self.write(f'{self.bright}{summary.table}{self.reset}: '
+                   f'{self.green}{summary.inserted} inserted{self.reset}, '
+                   f'{self.red}{summary.deleted} deleted{self.reset}, '
+                   f'{summary.updated} updated{unchanged}\n')
+        for name, n in zip(summary.columns, summary.col_changes):
+            if n:
+                self.write(f'    {name}: {n}\n')
+
+    def write_estimate(self, est: Estimate):
+        self.write(f'{self.bright}{est.table}{self.reset}: '
+                   f'~{est.change_rate:.2%} changed, estimated from a '
+                   f'{est.rate:.2%} sample of {est.rows1} -> {est.rows2} '
+                   f'rows\n')
+        for name in ('inserted', 'deleted', 'updated', 'unchanged'):
+            n, lo, hi = getattr(est, name)
+            self.write(f'    {name}: ~{n} [{lo}, {hi}]\n')
+
+    def flush(self):
+        if self.buf:
+            block = ''.join(self.buf)
+            self.buf.clear()
+            if self.queue is None:
+                self.out.write(block)
+            elif self.error is not None:
+                raise self.error
+            else:
+                self.queue.put(block)
+
+    def close(self):
+        if self.queue is None:
+            self.flush()
+            self.out.flush()
+        else:
+            if self.error is None:
+                self.flush()
+            self.queue.put(None)
+            self.thread.join()
+        if self.close_out:
+            self.out.close()
+        if self.error is not None:
+            raise self.error
+
+    def __enter__(self) -> 'Writer':
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def delta_fields(d: Delta) -> tuple[str, tuple | None, tuple | None]:
+    match d:
+        case Insert(row):
+            return 'insert', None, row
+        case Delete(row):
+            return 'delete', row, None
+        case Update(old_row, new_row):
+            return 'update', old_row, new_row
+
+
+class JSONLWriter(Writer):
+    # One JSON object per delta, e.g.
+    # {"table": "pdgdata", "op": "update", "old": {...}, "new": {...}}
+    def __init__(self, out: TextIO | None = None,
+                 chunk_size: int = CHUNK_SIZE, background: bool = False):
+        super().__init__(out, False, chunk_size, background)
+        self.table, self.names = None, []
+
+    def note(self, text: str):
+        self.write(json.dumps({'note': text}) + '\n')
+
+    def begin_table(self, table: str, columns: list, banner: bool = False):
+        self.table, self.names = table, [c.name for c in columns]
+
+    def write_summary(self, summary: Summary):
+        rec = asdict(summary)
+        rec['col_changes'] = dict(zip(rec.pop('columns'),
+                                      rec['col_changes']))
+        self.write(json.dumps(rec) + '\n')
+
+    def write_estimate(self, est: Estimate):
+        rec = asdict(est)
+        rec['change_rate'] = est.change_rate
+        self.write(json.dumps(rec) + '\n')
+
+    def format(self, d: Delta) -> str:
+        op, old, new = delta_fields(d)
+        rec = {'table': self.table, 'op': op}
+        if old is not None:
+            rec['old'] = dict(zip(self.names, old))
+        if new is not None:
+            rec['new'] = dict(zip(self.names, new))
+        return json.dumps(rec, default=json_default) + '\n'
+
+
+def json_default(val):
+    if isinstance(val, bytes):
+        return val.hex()
+    return str(val)
+
+
+class ParquetWriter:
+    # Columns are op, then old_<col> and new_<col> for every diffed column,
+    # typed from the reflected schema. A single table goes to the file at
+    # `path`; in --all_tables mode `path` is a directory of <table>.parquet.
+    ARROW_TYPES = {int: 'int64', float: 'float64', str: 'string',
+                   bytes: 'binary', bool: 'bool_'}
+
+    def __init__(self, path: str, per_table: bool = False,
+                 chunk_size: int = CHUNK_SIZE):
+        try:
+            import pyarrow
+            import pyarrow.parquet
+        except ImportError:
+            raise ImportError('parquet output requires pyarrow '
+                              '(pip install pdgapi-diff[parquet])')
+        self.pa, self.pq = pyarrow, pyarrow.parquet
+        self.path, self.per_table = path, per_table
+        self.chunk_size = chunk_size
+        self.writer = None
+        self.buf: list[Delta] = []
+        if per_table:
+            os.makedirs(path, exist_ok=True)
+
+    def arrow_type(self, column):
+        try:
+            name = self.ARROW_TYPES.get(column.type.python_type, 'string')
+        except NotImplementedError:
+            name = 'string'
+        return getattr(self.pa, name)()
+
+    def note(self, text: str):
+        print(text, file=sys.stderr)
+
+    def begin_table(self, table: str, columns: list, banner: bool = False):
+        self.end_table()
+        path = self.path
+        if self.per_table:
+            path = os.path.join(path, f'{table}.parquet')
+        types = [self.arrow_type(c) for c in columns]
+        self.stringify = [t == self.pa.string() for t in types]
+        fields = [self.pa.field('op', self.pa.string())]
+        for prefix in ('old_', 'new_'):
+            fields += [self.pa.field(prefix + c.name, t)
+                       for c, t in zip(columns, types)]
+        self.schema = self.pa.schema(fields)
+        self.writer = self.pq.ParquetWriter(path, self.schema)
+
+    def write_deltas(self, deltas: Iterable[Delta]):
+        if PROFILE.enabled:
+            deltas = PROFILE.deltas(deltas)
+        for d in deltas:
+            self.buf.append(d)
+            if len(self.buf) >= self.chunk_size:
+                self.flush()
+
+    def flush(self):
+        if not self.buf:
+            return
+        width = len(self.stringify)
+        cols: list[list] = [[] for _ in range(1 + 2 * width)]
+        for d in self.buf:
+            op, old, new = delta_fields(d)
+            cols[0].append(op)
+            for k, row in enumerate((old, new)):
+                for c in range(width):
+                    v = None if row is None else row[c]
+                    if v is not None and self.stringify[c]:
+                        v = str(v)
+                    cols[1 + k * width + c].append(v)
+        self.buf.clear()
+        arrays = [self.pa.array(vals, type=field.type)
+                  for vals, field in zip(cols, self.schema)]
+        self.writer.write_table(
+            self.pa.Table.from_arrays(arrays, schema=self.schema))
+
+    def end_table(self):
+        if self.writer is not None:
+            self.flush()
+            self.writer.close()
+            self.writer = None
+
+    def close(self):
+        self.end_table()
+
+    def __enter__(self) -> 'ParquetWriter':
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def make_writer(format: str = 'text', output: str | None = None,
+                color: bool | None = None, background: bool = False,
+                per_table: bool = False):
+    if format == 'parquet':
+        if not output:
+            raise ValueError('--format=parquet requires --output')
+        return ParquetWriter(output, per_table)
+
+    if format == 'jsonl':
+        writer = JSONLWriter(output and open(output, 'w'),
+                             background=background)
+    elif format == 'text':
+        writer = Writer(output and open(output, 'w'), color,
+                        background=background)
+    else:
+        raise ValueError(f'unknown output format: {format}')
+    writer.close_out = bool(output)
+    return writer
+
+
+def pprint(deltas: Iterable[Delta], **writer_opts):
+    with Writer(**writer_opts) as writer:
+        writer.write_deltas(deltas)
+
+
+def diff_table(db1: DB, db2: DB, table: str, max_dist = 1,
+               exclude_cols = ['id'], matcher = 'blocking', key = None,
+               engine = 'python', progress = True, jobs = 1,
+               intern = True, cache = False, cache_dir = None,
+               from_state = None, save_state = None,
+               pairing = 'greedy', memory_limit = None, where = None,
+               **rules) -> Iterable[Delta]:
+    if from_state or save_state:
+        state = DiffState.load(from_state) if from_state else None
+        deltas, new_state = incremental_diff(
+            db1, db2, table, state, max_dist, exclude_cols, matcher,
+            progress, jobs, cache, cache_dir, pairing)
+        if save_state:
+            new_state.save(save_state)
+        return deltas
+
+    comparator = Comparator.for_table(db1, table, exclude_cols, key,
+                                      **rules)
+    if key:
+        key = as_list(key)
+        names = [c.name for c in db1.columns(table, exclude_cols)]
+        rows1 = db1.iter_sorted(table, key, exclude_cols, where=where)
+        rows2 = db2.iter_sorted(table, key, exclude_cols, where=where)
+        key_idcs = [names.index(k) for k in key]
+        return merge_compare(rows1, rows2, key_idcs, max_dist, matcher,
+                             pairing, comparator)
+
+    if engine == 'sqlite':
+        rows1, rows2 = db1.residual_rows(table, db2.path, exclude_cols,
+                                         where)
+        compare_fn = match_residual
+    elif cache:
+        rows1, rows2 = cached_residual_rows(db1, db2, table, exclude_cols,
+                                            cache_dir, where)
+        compare_fn = match_residual
+    elif memory_limit:
+        rows1, rows2 = external_residual_rows(db1, db2, table, exclude_cols,
+                                              memory_limit, where)
+        compare_fn = match_residual
+    else:
+        # interned rows are encoded as they stream in, so the fetched
+        # tuples are never all held at once
+        fetch = 'iter_rows' if intern else 'get_all'
+        rows1 = getattr(db1, fetch)(table, exclude_cols, where=where)
+        rows2 = getattr(db2, fetch)(table, exclude_cols, where=where)
+        compare_fn = compare
+
+    if intern:
+        compare_fn = partial(Interner().compare, compare_fn)
+    args = (max_dist, matcher, progress, jobs, pairing)
+    if comparator:
+        return comparator.compare(compare_fn, rows1, rows2, *args)
+    return compare_fn(rows1, rows2, *args)
+
+
+def summarize_table(db1: DB, db2: DB, table: str, max_dist = 1,
+                    exclude_cols = ['id'], matcher = 'blocking',
+                    progress = True, jobs = 1, intern = True,
+                    pairing = 'greedy', **opts) -> Summary:
+    summary = Summary(table, [c.name for c in db1.columns(table,
+                                                          exclude_cols)])
+    if (opts.get('key') or opts.get('engine', 'python') != 'python'
+            or opts.get('cache') or opts.get('memory_limit')
+            or opts.get('from_state') or opts.get('save_state')):
+        # these modes never see the unchanged rows; count their deltas
+        summary.unchanged = None
+        for d in diff_table(db1, db2, table, max_dist, exclude_cols,
+                            matcher, progress=progress, jobs=jobs,
+                            intern=False, pairing=pairing, **opts):
+            summary.add_delta(d)
+        return summary
+
+    fetch = 'iter_rows' if intern else 'get_all'
+    rows1 = getattr(db1, fetch)(table, exclude_cols, where=opts.get('where'))
+    rows2 = getattr(db2, fetch)(table, exclude_cols, where=opts.get('where'))
+    rules = {k: opts[k] for k in RULES if k in opts}
+    if comparator := Comparator.for_table(db1, table, exclude_cols,
+                                          **rules):
+        rows1, rows2 = comparator.canonical(rows1, rows2)
+    interner = Interner() if intern else None
+    if interner:
+        rows1, rows2 = interner.encode(rows1), interner.encode(rows2)
+
+    res1, res2 = split_exact(rows1, rows2)
+    summary.unchanged = len(rows1) - len(res1)
+    matched2 = set()
+    pairs = iter_pairs(res1, res2, max_dist, matcher, progress, jobs,
+                       pairing)
+    with interner.decoding() if interner else nullcontext():
+        for i, j in pairs:
+            if j is None:
+                summary.deleted += 1
+            else:
+                matched2.add(j)
+                if changed := changed_cols(res1[i], res2[j]):
+                    summary.add_update(changed)
+                else:
+                    summary.unchanged += 1
+    summary.inserted = len(res2) - len(matched2)
+    return summary
+
+
+def sample_rows(db: DB, table: str, exclude_cols: list | None, rate: float,
+                key_idcs: list[int] | None = None, canon=None,
+                where: str | None = None) -> tuple[list[tuple], int]:
+    # One streaming scan, keeping the rows whose key columns (or whole row)
+    # hash below rate. Both sides hash alike, so they keep the same keys
+    # and the same unchanged rows, and only the sample is ever held.
+    threshold = int(rate * 2**64)
+    sample, n = [], 0
+    for row in db.iter_rows(table, exclude_cols, where=where):
+        n += 1
+        if canon:
+            row = canon(row)
+        if fingerprint(row if key_idcs is None
+                       else tuple(row[i] for i in key_idcs)) < threshold:
+            sample.append(row)
+    PROFILE.count('rows_sampled', len(sample))
+    return sample, n
+
+
+def scaled(n: int, p: float) -> tuple[float, float]:
+    # a count observed with inclusion probability p, and its variance
+    return n / p, n * (1 - p) / p**2
+
+
+def interval(est: float, var: float, p: float,
+             cap: int) -> tuple[int, int, int]:
+    # ~95% normal interval, clipped to [0, cap]; with nothing observed, the
+    # rule of three
+    if not var:
+        lo, hi = est, est + 3 / p if p < 1 else est
+    else:
+        sd = 1.96 * var**0.5
+        lo, hi = est - sd, est + sd
+    return tuple(round(min(max(v, 0), cap)) for v in (est, lo, hi))
+
+
+def estimate_table(db1: DB, db2: DB, table: str, sample: float,
+                   max_dist = 1, exclude_cols = ['id'],
+                   matcher = 'blocking', key = None, pairing = 'greedy',
+                   where = None, **opts) -> Estimate:
+    rules = {k: opts[k] for k in RULES if k in opts}
+    comparator = Comparator.for_table(db1, table, exclude_cols, key,
+                                      **rules)
+    canon1, canon2 = ((comparator.canon1, comparator.canon2) if comparator
+                      else (None, None))
+    names = [c.name for c in db1.columns(table, exclude_cols)]
+    key_idcs = [names.index(k) for k in as_list(key)] if key else None
+    rows1, n1 = sample_rows(db1, table, exclude_cols, sample, key_idcs,
+                            canon1, where)
+    rows2, n2 = sample_rows(db2, table, exclude_cols, sample, key_idcs,
+                            canon2, where)
+
+    if key_idcs:
+        order = lambda r: tuple(sqlite_order(r[i]) for i in key_idcs)
+        deltas = merge_compare(sorted(rows1, key=order),
+                               sorted(rows2, key=order), key_idcs, max_dist,
+                               matcher, pairing)
+    else:
+        deltas = compare(rows1, rows2, max_dist, matcher, progress=False,
+                         pairing=pairing)
+    seen = Summary(table, names)
+    for d in deltas:
+        seen.add_delta(d)
+
+    # An update changes the row hash, so without a key both of its versions
+    # are sampled with probability sample**2 only; when just one is, it
+    # shows up as a delete or insert, which is subtracted back out.
+    p_upd = sample if key_idcs else sample**2
+    upd, var_upd = scaled(seen.updated, p_upd)
+    split = 1 - p_upd / sample
+    ins, var_ins = scaled(seen.inserted, sample)
+    dels, var_dels = scaled(seen.deleted, sample)
+    same, var_same = scaled(len(rows1) - seen.deleted - seen.updated, sample)
+    return Estimate(
+        table, n1, n2, sample,
+        interval(ins - split * upd, var_ins + split**2 * var_upd, sample,
+                 n2),
+        interval(dels - split * upd, var_dels + split**2 * var_upd, sample,
+                 n1),
+        interval(upd, var_upd, p_upd, min(n1, n2)),
+        interval(same, var_same, sample, min(n1, n2)))
+
+
+def match_ids(db1: DB, db2: DB, table: str, id_col: str, max_dist = 1,
+              exclude_cols = ['id'], matcher = 'blocking', jobs = 1,
+              pairing = 'greedy', intern = True, **opts) -> dict:
+    # Pairs the rows of a parent table on everything but id_col and maps
+    # each old id to the id of its partner
+    keep = [c for c in exclude_cols if c != id_col]
+    cols = db1.columns(table, keep)
+    k = [c.name for c in cols].index(id_col)
+    del cols[k]
+    rows1, rows2 = db1.get_all(table, keep), db2.get_all(table, keep)
+    ids1, ids2 = [r[k] for r in rows1], [r[k] for r in rows2]
+    rows1 = [r[:k] + r[k + 1:] for r in rows1]
+    rows2 = [r[:k] + r[k + 1:] for r in rows2]
+
+    comparator = Comparator(cols, **{r: opts[r] for r in RULES if r in opts})
+    if comparator.active:
+        rows1, rows2 = comparator.canonical(rows1, rows2)
+    interner = Interner() if intern else None
+    if interner:
+        rows1, rows2 = interner.encode(rows1), interner.encode(rows2)
+
+    pairs = pair_rows(rows1, rows2, max_dist, matcher, jobs, pairing)
+    with interner.decoding() if interner else nullcontext():
+        return {ids1[i]: ids2[j] for i, j in pairs}
+
+
+def diff_with_ids(db1: DB, db2: DB, table: str, id_cols: list[str],
+                  max_dist = 1, exclude_cols = ['id'], matcher = 'blocking',
+                  jobs = 1, pairing = 'greedy', intern = True,
+                  summary = False, **opts
+                  ) -> tuple[list[Delta] | Summary, dict[str, dict]]:
+    # The diff of a parent table and the old-id -> new-id maps of its
+    # referenced columns from one pairing: the excluded id columns are
+    # fetched alongside the compared ones and split off before matching.
+    keep = [c for c in exclude_cols if c not in id_cols]
+    names = [c.name for c in db1.columns(table, keep)]
+    idx = [names.index(c) for c in id_cols]
+    rest = [k for k in range(len(names)) if k not in idx]
+    fetched1, fetched2 = db1.get_all(table, keep), db2.get_all(table, keep)
+    rows1 = [tuple(r[k] for k in rest) for r in fetched1]
+    rows2 = [tuple(r[k] for k in rest) for r in fetched2]
+
+    rules = {r: opts[r] for r in RULES if r in opts}
+    comp1, comp2 = rows1, rows2
+    if comparator := Comparator.for_table(db1, table, exclude_cols,
+                                          **rules):
+        comp1, comp2 = comparator.canonical(rows1, rows2)
+    interner = Interner() if intern else None
+    if interner:
+        comp1, comp2 = interner.encode(comp1), interner.encode(comp2)
+    with interner.decoding() if interner else nullcontext():
+        pairs = dict(pair_rows(comp1, comp2, max_dist, matcher, jobs,
+                               pairing))
+
+    id_maps = {c: {fetched1[i][k]: fetched2[j][k] for i, j in pairs.items()}
+               for c, k in zip(id_cols, idx)}
+    # in compare()'s order: Deletes and Updates by old row, then Inserts
+    deltas: list[Delta] = []
+    for i, row in enumerate(rows1):
+        if i not in pairs:
+            deltas.append(Delete(row))
+        elif changed := changed_cols(comp1[i], comp2[pairs[i]]):
+            deltas.append(Update(row, rows2[pairs[i]], changed))
+    matched2 = set(pairs.values())
+    deltas += [Insert(row) for j, row in enumerate(rows2)
+               if j not in matched2]
+    if not summary:
+        return deltas, id_maps
+
+    result = Summary(table, [names[k] for k in rest])
+    for d in deltas:
+        result.add_delta(d)
+    result.unchanged = len(rows1) - result.deleted - result.updated
+    return result, id_maps
+
+
+def fk_waves(fks: dict[str, list]) -> list[list[str]]:
+    # Tables in waves whose parents all come in earlier waves. On a cycle
+    # the remaining tables form one last wave, and the FKs between them
+    # are compared as they are.
+    deps = {t: {ref for _, ref, _ in links if ref != t}
+            for t, links in fks.items()}
+    waves, done = [], set()
+    while len(done) < len(deps):
+        wave = ([t for t in deps if t not in done and deps[t] <= done]
+                or [t for t in deps if t not in done])
+        waves.append(wave)
+        done.update(wave)
+    return waves
+
+
+_worker_dbs: tuple[DB, DB] | None = None
+
+
+def _init_worker(path1: str, path2: str, readonly: bool, profile: bool):
+    global _worker_dbs
+    PROFILE.reset(profile)
+    _worker_dbs = DB(path1, readonly), DB(path2, readonly)
+
+
+def _diff_worker(table: str, opts: dict
+                 ) -> tuple[list[list[Delta] | Summary | Estimate | str],
+                            dict, dict]:
+    db1, db2 = _worker_dbs
+    PROFILE.reset(PROFILE.enabled)
+    opts = dict(opts)
+    summary, id_cols = opts.pop('summary', False), opts.pop('id_cols', ())
+    sample = opts.pop('sample', None)
+    escalate_above = opts.pop('escalate_above', None)
+    results = []
+    if sample:
+        results.append(estimate_table(db1, db2, table, sample, **opts))
+        if (escalate_above is None
+                or results[0].change_rate <= escalate_above):
+            return results, {}, PROFILE.as_dict()
+    try:
+        if id_cols and not opts.get('key') and set(id_cols) <= set(
+                opts['exclude_cols']):
+            result, id_maps = diff_with_ids(db1, db2, table, id_cols,
+                                            summary=summary, **opts)
+            results.append(result)
+            return results, id_maps, PROFILE.as_dict()
+
+        # the ids are compared too, or the rows merge-joined by key: the
+        # maps need a pairing of their own
+        id_maps = {c: match_ids(db1, db2, table, c, **opts)
+                   for c in id_cols}
+        if summary:
+            results.append(summarize_table(db1, db2, table, progress=False,
+                                           **opts))
+        else:
+            results.append(list(diff_table(db1, db2, table, progress=False,
+                                           **opts)))
+    except MatchError as e:
+        # reported as a note; any child tables compare their raw FKs
+        return [f'{e}; table skipped'], {}, PROFILE.as_dict()
+    return results, id_maps, PROFILE.as_dict()
+
+
+def diff_all_tables(path1: str, path2: str, jobs: int | None = None,
+                    readonly: bool = True, note = print,
+                    follow_fks: bool = False, **opts
+                    ) -> Iterator[tuple[str, list,
+                                        list[Delta] | Summary | Estimate]]:
+    db1, db2 = DB(path1, readonly), DB(path2, readonly)
+    for db, other in ((db1, db2), (db2, db1)):
+        other_names = set(other.table_names())
+        only = [t for t in db.table_names() if t not in other_names]
+        if only:
+            note(f'tables only in {db.path}: {only}')
+    tables = db1.common_tables(db2)
+
+    # With follow_fks, parent tables are diffed first, and the old-id ->
+    # new-id map of each referenced column is used to rewrite the
+    # foreign keys of its child tables before they are matched.
+    fks = {t: [] for t in tables}
+    if follow_fks:
+        common = set(tables)
+        fks = {t: [fk for fk in db1.foreign_keys(t) if fk[1] in common]
+               for t in tables}
+    id_cols = defaultdict(set)
+    for links in fks.values():
+        for _, ref, ref_col in links:
+            id_cols[ref].add(ref_col)
+    id_maps: dict[tuple[str, str], dict] = {}
+
+    # a --key missing from some tables applies to the others only
+    keyless = set()
+    if opts.get('key'):
+        key = as_list(opts['key'])
+        for table in tables:
+            names = ({c.name for c in db1.columns(table, opts['exclude_cols'])}
+                     & {c.name for c in db2.columns(table,
+                                                    opts['exclude_cols'])})
+            if missing := [k for k in key if k not in names]:
+                note(f'{table} has no key column {missing}; '
+                     f'matched on whole rows')
+                keyless.add(table)
+
+    from concurrent.futures import ProcessPoolExecutor
+    from tqdm import tqdm
+    with ProcessPoolExecutor(jobs, initializer=_init_worker,
+                             initargs=(path1, path2, readonly,
+                                       PROFILE.enabled)) as pool:
+        for wave in fk_waves(fks):
+            wave_opts = []
+            for table in wave:
+                remaps = {col: id_maps[ref, ref_col]
+                          for col, ref, ref_col in fks[table]
+                          if (ref, ref_col) in id_maps}
+                table_opts = dict(opts, id_cols=sorted(id_cols[table]),
+                                  remaps=remaps or None)
+                if table in keyless:
+                    table_opts['key'] = None
+                wave_opts.append(table_opts)
+            results = pool.map(_diff_worker, wave, wave_opts)
+            for table, (results, maps, profile) in zip(
+                    wave, tqdm(results, total=len(wave))):
+                PROFILE.merge(profile)
+                id_maps.update(((table, c), m) for c, m in maps.items())
+                cols = db1.columns(table, opts['exclude_cols'])
+                for result in results:
+                    if isinstance(result, str):
+                        note(f'{table}: {result}')
+                    else:
+                        yield table, cols, result
+
+
+def run_compare(path1: str, path2: str, table: str | None = None,
+                max_dist = 1, exclude_cols = ['id'],
+                matcher = 'blocking', key = None, engine = 'python',
+                all_tables = False, jobs = None, readonly = True,
+                intern = True, cache = False, cache_dir = None,
+                from_state = None, save_state = None, color = None,
+                background_output = False, format = 'text', output = None,
+                summary = False, profile = False, pairing = 'greedy',
+                tolerance = None, ignore_case = False, ignore_space = False,
+                null_empty = False, follow_fks = False,
+                memory_limit = None, where = None, columns = None,
+                lite = False, sample = None, escalate_above = None):
+    opts = dict(max_dist=max_dist, exclude_cols=exclude_cols,
+                matcher=matcher, key=key, engine=engine, intern=intern,
+                cache=cache, cache_dir=cache_dir, pairing=pairing,
+                tolerance=tolerance, ignore_case=ignore_case,
+                ignore_space=ignore_space, null_empty=null_empty,
+                memory_limit=memory_limit, where=where)
+
+    if lite and (all_tables or engine != 'python'):
+        raise ValueError('--lite supports single-table diffs on the python '
+                         'engine only')
+    if all_tables and (where or columns):
+        raise ValueError('--where and --columns apply to a single --table')
+    if (from_state or save_state) and where:
+        raise ValueError('diff states cover whole tables; they cannot be '
+                         'combined with --where')
+    if key and engine == 'sqlite':
+        raise ValueError('--key merge-joins the sorted rows in Python; it '
+                         'cannot be combined with --engine=sqlite')
+    if key and (from_state or save_state):
+        raise ValueError('diff states pair rows by fingerprint; they cannot '
+                         'be combined with --key')
+    if follow_fks and not all_tables:
+        raise ValueError('--follow_fks requires --all_tables')
+    if memory_limit is not None and memory_limit <= 0:
+        raise ValueError('--memory_limit is in MiB and must be positive')
+    if follow_fks and (engine != 'python' or cache or memory_limit):
+        raise ValueError('--follow_fks needs the python engine without '
+                         '--cache or --memory_limit, as the other pre-passes '
+                         'compare the raw foreign keys')
+    if all_tables and (from_state or save_state):
+        raise ValueError('diff states are per table; '
+                         'they cannot be used with --all_tables')
+    if not all_tables and table is None:
+        raise ValueError('a table is required unless --all_tables is given')
+    if summary and format == 'parquet':
+        raise ValueError('--summary supports text and jsonl output only')
+    if pairing not in ('greedy', 'assignment'):
+        raise ValueError(f'unknown pairing: {pairing}')
+    if (from_state or save_state) and (tolerance or ignore_case
+                                       or ignore_space or null_empty):
+        raise ValueError('diff states compare rows exactly; they cannot be '
+                         'combined with comparison rules')
+    if sample is not None and not 0 < sample <= 1:
+        raise ValueError('--sample is the fraction of rows to sample, '
+                         'in (0, 1]')
+    if escalate_above is not None and not sample:
+        raise ValueError('--escalate_above requires --sample')
+    if sample and (follow_fks or from_state or save_state):
+        raise ValueError('--sample cannot be combined with --follow_fks or '
+                         'diff states, which need every row matched')
+    if sample and format == 'parquet':
+        raise ValueError('--sample supports text and jsonl output only')
+
+    with (profiling(profile),
+          make_writer(format, output, color, background_output,
+                      per_table=all_tables) as writer):
+        if all_tables:
+            for table, cols, result in diff_all_tables(
+                    path1, path2, jobs, readonly, writer.note,
+                    follow_fks, summary=summary, sample=sample,
+                    escalate_above=escalate_above, **opts):
+                if isinstance(result, Estimate):
+                    writer.write_estimate(result)
+                elif summary:
+                    writer.write_summary(result)
+                else:
+                    writer.begin_table(table, cols, banner=True)
+                    writer.write_deltas(result)
+            return
+
+        db_class = LiteDB if lite else DB
+        db1, db2 = db_class(path1, readonly), db_class(path2, readonly)
+        if columns:
+            exclude_cols = opts['exclude_cols'] = only_columns(db1, table,
+                                                               columns)
+
+        if sample:
+            # the exact diff follows only for a table that changed enough
+            estimate = estimate_table(db1, db2, table, sample, **opts)
+            writer.write_estimate(estimate)
+            if (escalate_above is None
+                    or estimate.change_rate <= escalate_above):
+                return
 
+        if summary:
+            writer.write_summary(summarize_table(
+                db1, db2, table, jobs=jobs, from_state=from_state,
+                save_state=save_state, **opts))
+            return
 
-def run_compare(path1: str, path2: str, table: str,
-                max_dist = 1, exclude_cols = ['id']):
-    db1, db2 = DB(path1), DB(path2)
-    rows1 = db1.get_all(table, exclude_cols)
-    rows2 = db2.get_all(table, exclude_cols)
-    deltas = compare(rows1, rows2, max_dist)
-    pprint(deltas)
+        deltas = diff_table(db1, db2, table, jobs=jobs,
+                            from_state=from_state, save_state=save_state,
+                            **opts)
+        writer.begin_table(table, db1.columns(table, exclude_cols))
+        writer.write_deltas(deltas)
 
 
 def main():
     import fire
-    fire.Fire(run_compare)
+    if sys.argv[1:2] == ['serve']:
+        from pdgapi_diff.cli.serve import serve
+        fire.Fire(serve, command=sys.argv[2:])
+    else:
+        fire.Fire(run_compare)
@@ -0,0 +1,167 @@
+from collections import OrderedDict
+from concurrent.futures import ThreadPoolExecutor
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+import io
+import json
+import os
+import sys
+from typing import Iterator
+
+from pdgapi_diff.cli.pdgapi_diff import (
+    BATCH_SIZE, DB, JSONLWriter, RULES, Writer, _reflection_cache, diff_table,
+    only_columns, summarize_table)
+
+# Only options that read the two databases; the state and cache options
+# would let any client write files, so they are refused.
+OPTIONS = {'max_dist', 'exclude_cols', 'matcher', 'key', 'pairing', 'where',
+           'columns', *RULES} - {'remaps'}
+
+
+class WarmDB(DB):
+    # Keeps every whole table it has fetched, so repeat diffs skip SQLite.
+    # Filtered fetches are not kept: they are usually index lookups, and
+    # one list per --where predicate would grow without bound. The rowid
+    # scans used by the incremental and out-of-core modes also go to the
+    # database.
+    def __init__(self, path, readonly = True):
+        super().__init__(path, readonly)
+        self.rows: dict[tuple, list[tuple]] = {}
+
+    def get_all(self, table: str, exclude_cols: list | None = None,
+                where: str | None = None) -> list[tuple]:
+        if where:
+            return list(super().iter_rows(table, exclude_cols, where=where))
+        key = (table, tuple(exclude_cols or ()))
+        if key not in self.rows:
+            self.rows[key] = list(super().iter_rows(table, exclude_cols))
+        return self.rows[key]
+
+    def iter_rows(self, table: str, exclude_cols: list | None = None,
+                  batch_size: int = BATCH_SIZE, with_rowid: bool = False,
+                  where: str | None = None) -> Iterator[tuple]:
+        if with_rowid or where:
+            return super().iter_rows(table, exclude_cols, batch_size,
+                                     with_rowid, where)
+        return iter(self.get_all(table, exclude_cols))
+
+
+class DiffService:
+    # Open databases and rendered results, both LRU-bounded and keyed by
+    # file contents (path, mtime, size), so a rewritten file is reopened
+    # rather than served stale. All database work runs on one thread, as
+    # the SQLite connections must stay on the thread that opened them;
+    # requests are accepted concurrently and queue for it.
+    def __init__(self, readonly = True, max_dbs = 8, max_results = 64):
+        self.readonly = readonly
+        self.max_dbs, self.max_results = max_dbs, max_results
+        self.dbs: OrderedDict[tuple, WarmDB] = OrderedDict()
+        self.results: OrderedDict[tuple, str] = OrderedDict()
+        self.executor = ThreadPoolExecutor(1)
+
+    def db(self, path: str) -> tuple[tuple, WarmDB]:
+        st = os.stat(path)
+        key = (os.path.realpath(path), st.st_mtime_ns, st.st_size)
+        if key in self.dbs:
+            self.dbs.move_to_end(key)
+        else:
+            self.dbs[key] = WarmDB(path, self.readonly)
+            if len(self.dbs) > self.max_dbs:
+                _, old = self.dbs.popitem(last=False)
+                old.engine.dispose()
+                _reflection_cache.pop(old.cache_key, None)
+        return key, self.dbs[key]
+
+    def diff(self, request: dict) -> str:
+        opts = dict(request)
+        path1, path2 = opts.pop('path1'), opts.pop('path2')
+        table = opts.pop('table')
+        format = opts.pop('format', 'jsonl')
+        summary = opts.pop('summary', False)
+        if unknown := sorted(set(opts) - OPTIONS):
+            raise ValueError(f'unsupported options: {unknown}')
+
+        key1, db1 = self.db(path1)
+        key2, db2 = self.db(path2)
+        key = (key1, key2, table, format, summary,
+               json.dumps(opts, sort_keys=True))
+        if key in self.results:
+            self.results.move_to_end(key)
+            return self.results[key]
+
+        out = io.StringIO()
+        if format == 'jsonl':
+            writer = JSONLWriter(out)
+        elif format == 'text':
+            writer = Writer(out, color=False)
+        else:
+            raise ValueError(f'unknown output format: {format}')
+        if columns := opts.pop('columns', None):
+            opts['exclude_cols'] = only_columns(db1, table, columns)
+        with writer:
+            if summary:
+                writer.write_summary(summarize_table(
+                    db1, db2, table, progress=False, **opts))
+            else:
+                exclude_cols = opts.get('exclude_cols', ['id'])
+                deltas = diff_table(db1, db2, table, progress=False, **opts)
+                writer.begin_table(table, db1.columns(table, exclude_cols))
+                writer.write_deltas(deltas)
+
+        self.results[key] = out.getvalue()
+        if len(self.results) > self.max_results:
+            self.results.popitem(last=False)
+        return self.results[key]
+
+
+class DiffHandler(BaseHTTPRequestHandler):
+    # POST /diff with a JSON object: path1, path2 and table, plus any of
+    # OPTIONS and optionally format ('jsonl' or 'text') and summary. The
+    # response body is the diff in that format. Requiring application/json
+    # keeps browsers from sending cross-origin requests without a preflight.
+    def do_POST(self):
+        if self.path != '/diff':
+            self.reply(404, {'error': f'no such endpoint: {self.path}'})
+            return
+        content_type = self.headers.get('Content-Type', '')
+        if content_type.split(';')[0].strip() != 'application/json':
+            self.reply(415, {'error': 'Content-Type must be '
+                                      'application/json'})
+            return
+        try:
+            length = int(self.headers.get('Content-Length', 0))
+            request = json.loads(self.rfile.read(length))
+            service = self.server.service
+            body = service.executor.submit(service.diff, request).result()
+        except (AssertionError, KeyError, OSError, TypeError,
+                ValueError) as e:
+            self.reply(400, {'error': f'{type(e).__name__}: {e}'})
+            return
+        except Exception as e:
+            # e.g. SQLAlchemy errors for a missing table; keep serving
+            self.reply(500, {'error': f'{type(e).__name__}: {e}'})
+            return
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/x-ndjson'
+                         if request.get('format', 'jsonl') == 'jsonl'
+                         else 'text/plain')
+        self.end_headers()
+        self.wfile.write(body.encode())
+
+    def reply(self, status: int, obj: dict):
+        self.send_response(status)
+        self.send_header('Content-Type', 'application/json')
+        self.end_headers()
+        self.wfile.write(json.dumps(obj).encode() + b'\n')
+
+
+def serve(host: str = '127.0.0.1', port: int = 8765, readonly = True,
+          max_dbs = 8, max_results = 64):
+    server = ThreadingHTTPServer((host, port), DiffHandler)
+    server.service = DiffService(readonly, max_dbs, max_results)
+    print(f'serving diffs on http://{host}:{port}/diff', file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
@@ -0,0 +1,383 @@
+from collections import Counter
+from decimal import Decimal
+import io
+import json
+import math
+import random
+import sqlite3
+
+import pytest
+
+from pdgapi_diff.cli import pdgapi_diff as pd
+
+
+def random_tables(rnd: random.Random, width: int = 4,
+                  n: int = 12) -> tuple[list[tuple], list[tuple]]:
+    # a small old table and a new one with edits, deletes and inserts, over
+    # few enough values that rows often collide or tie
+    pool = [tuple(rnd.randint(0, 2) for _ in range(width))
+            for _ in range(40)]
+    rows1 = list(dict.fromkeys(rnd.sample(pool, rnd.randint(0, n))))
+    rows2 = []
+    for row in rows1:
+        if rnd.random() < 0.1:
+            continue
+        if rnd.random() < 0.3:
+            row = list(row)
+            row[rnd.randrange(width)] = rnd.randint(0, 5)
+            row = tuple(row)
+        rows2.append(row)
+    rows2 = list(dict.fromkeys(rows2 + rnd.sample(pool, rnd.randint(0, 3))))
+    rnd.shuffle(rows2)
+    return rows1, rows2
+
+
+def outcome(deltas) -> list | str:
+    # order-independent deltas, or 'ambiguous' when greedy pairing refuses
+    try:
+        return sorted(repr((type(d).__name__, d.row,
+                            getattr(d, 'new_row', None))) for d in deltas)
+    except AssertionError:
+        return 'ambiguous'
+
+
+def make_table(path, columns: str, rows: list[tuple]) -> str:
+    # table t with an INTEGER PRIMARY KEY id ahead of the given columns
+    conn = sqlite3.connect(path)
+    conn.execute(f'CREATE TABLE t (id INTEGER PRIMARY KEY, {columns})')
+    names = [c.split()[0] for c in columns.split(', ')]
+    marks = ', '.join('?' * len(names))
+    names = ', '.join(names)
+    conn.executemany(f'INSERT INTO t ({names}) VALUES ({marks})', rows)
+    conn.commit()
+    conn.close()
+    return str(path)
+
+
+def make_db(path, rows: list[tuple]) -> str:
+    return make_table(path, 'a INTEGER, b INTEGER, c INTEGER, d INTEGER',
+                      rows)
+
+
+@pytest.mark.parametrize('max_dist', [0, 1, 2, 3])
+def test_blocking_matches_bruteforce(max_dist):
+    rnd = random.Random(max_dist)
+    for _ in range(300):
+        rows1, rows2 = random_tables(rnd, rnd.randint(1, 6))
+        expected = outcome(pd.compare(rows1, rows2, max_dist, 'bruteforce',
+                                      progress=False))
+        assert outcome(pd.compare(rows1, rows2, max_dist, 'blocking',
+                                  progress=False)) == expected
+
+
+def test_interned_matches_plain():
+    rnd = random.Random(0)
+    for _ in range(300):
+        rows1, rows2 = random_tables(rnd)
+        expected = outcome(pd.compare(rows1, rows2, 1, progress=False))
+        assert outcome(pd.Interner().compare(
+            pd.compare, rows1, rows2, 1, 'blocking', False)) == expected
+
+
+def test_assignment_matches_greedy_when_unambiguous():
+    rnd = random.Random(1)
+    checked = 0
+    for _ in range(500):
+        rows1, rows2 = random_tables(rnd)
+        greedy = outcome(pd.compare(rows1, rows2, 1, progress=False))
+        if greedy == 'ambiguous':
+            continue
+        checked += 1
+        assert outcome(pd.compare(rows1, rows2, 1, progress=False,
+                                  pairing='assignment')) == greedy
+    assert checked > 100
+
+
+def test_incremental_matches_direct(tmp_path):
+    rnd = random.Random(2)
+    for k in range(40):
+        rows1, rows2 = random_tables(rnd)
+        if k % 2:
+            rows1, rows2 = rows1 + rows1[:2], rows2 + rows2[:1]
+        db1 = pd.LiteDB(make_db(tmp_path / f'{k}a.db', rows1))
+        db2 = pd.LiteDB(make_db(tmp_path / f'{k}b.db', rows2))
+        expected = outcome(pd.diff_table(db1, db2, 't', intern=False,
+                                         progress=False))
+        if expected == 'ambiguous':
+            continue
+        deltas, state = pd.incremental_diff(db1, db2, 't', None,
+                                            progress=False)
+        assert outcome(deltas) == expected
+        # rerunning from the saved state reuses every pairing
+        deltas, _ = pd.incremental_diff(db1, db2, 't', state,
+                                        progress=False)
+        assert outcome(deltas) == expected
+
+
+def test_incremental_restores_duplicates(tmp_path):
+    x, y = (1, 1, 1, 1), (2, 2, 2, 2)
+    base = pd.LiteDB(make_db(tmp_path / 'base.db', [x, x, x, y]))
+    cand1 = pd.LiteDB(make_db(tmp_path / 'cand1.db', [x, y]))
+    cand2 = pd.LiteDB(make_db(tmp_path / 'cand2.db', [x, x, x, y]))
+    deltas, state = pd.incremental_diff(base, cand1, 't', None,
+                                        progress=False)
+    assert outcome(deltas) == outcome([pd.Delete(x), pd.Delete(x)])
+    deltas, _ = pd.incremental_diff(base, cand2, 't', state, progress=False)
+    assert deltas == []
+
+
+def test_residuals_match_split_exact(tmp_path, monkeypatch):
+    # four rows per spilled run, so the merge sees many runs
+    monkeypatch.setattr(pd, 'SPILL_ENTRY_BYTES', 2**17)
+    rnd = random.Random(3)
+    for k in range(20):
+        rows1, rows2 = random_tables(rnd, n=30)
+        # duplicates exercise the per-fingerprint counts
+        rows1 += rows1[:3]
+        db1 = pd.LiteDB(make_db(tmp_path / f'{k}a.db', rows1))
+        db2 = pd.LiteDB(make_db(tmp_path / f'{k}b.db', rows2))
+        res1, res2 = pd.split_exact(db1.get_all('t', ['id']),
+                                    db2.get_all('t', ['id']))
+        expected = Counter(res1), Counter(res2)
+
+        cached = pd.cached_residual_rows(db1, db2, 't', ['id'],
+                                         str(tmp_path / 'cache'))
+        assert tuple(map(Counter, cached)) == expected
+        external = pd.external_residual_rows(db1, db2, 't', ['id'], 1)
+        assert tuple(map(Counter, external)) == expected
+
+
+def test_merge_join_matches_full_diff(tmp_path):
+    rnd = random.Random(4)
+    for k in range(40):
+        rows1, rows2 = random_tables(rnd)
+        # the first column becomes a text key, unique on each side
+        key1 = [(f'k{i}',) + r[1:] for i, r in enumerate(rows1)]
+        key2 = [(f'k{i}',) + r[1:] for i, r in enumerate(rows2)]
+        cols = 'pdgid TEXT, b INTEGER, c INTEGER, d INTEGER'
+        db1 = pd.LiteDB(make_table(tmp_path / f'{k}a.db', cols, key1))
+        db2 = pd.LiteDB(make_table(tmp_path / f'{k}b.db', cols, key2))
+        merged = outcome(pd.diff_table(db1, db2, 't', key='pdgid',
+                                       progress=False))
+        # each key group holds at most one row per side, so the diff is
+        # decided pair by pair
+        by_key = {r[0]: r for r in key2}
+        expected = []
+        for row in key1:
+            other = by_key.pop(row[0], None)
+            if other is None:
+                expected.append(pd.Delete(row))
+            elif pd.distance(row, other) > 1:
+                expected += [pd.Delete(row), pd.Insert(other)]
+            elif row != other:
+                expected.append(pd.Update(row, other))
+        expected += [pd.Insert(r) for r in by_key.values()]
+        assert merged == outcome(expected)
+
+
+def test_merge_join_ignores_declared_collation(tmp_path):
+    cols = 'pdgid TEXT COLLATE NOCASE, v INTEGER'
+    db1 = pd.LiteDB(make_table(tmp_path / 'a.db', cols, [('a', 1),
+                                                         ('B', 1)]))
+    db2 = pd.LiteDB(make_table(tmp_path / 'b.db', cols, [('B', 1)]))
+    deltas = pd.diff_table(db1, db2, 't', key='pdgid', progress=False)
+    assert outcome(deltas) == outcome([pd.Delete(('a', 1))])
+
+
+def test_sqlite_engine_residuals_match_split_exact(tmp_path):
+    pytest.importorskip('sqlalchemy')
+    rnd = random.Random(5)
+    for k in range(20):
+        rows1, rows2 = random_tables(rnd, n=30)
+        # ROW_NUMBER() must pair duplicates off one-for-one
+        rows1 += rows1[:3]
+        rows2 += rows2[:2]
+        path1 = make_db(tmp_path / f'{k}a.db', rows1)
+        path2 = make_db(tmp_path / f'{k}b.db', rows2)
+        res1, res2 = pd.split_exact(rows1, rows2)
+        residual = pd.DB(path1).residual_rows('t', path2, ['id'])
+        assert tuple(map(Counter, residual)) == (Counter(res1),
+                                                 Counter(res2))
+
+
+def writer_deltas() -> list:
+    rnd = random.Random(6)
+    deltas = []
+    for _ in range(200):
+        row = tuple(rnd.randint(0, 9) for _ in range(4))
+        new_row = row[:3] + (row[3] + 1,)
+        deltas.append(rnd.choice([pd.Insert(row), pd.Delete(row),
+                                  pd.Update(row, new_row)]))
+    return deltas
+
+
+def test_background_writer_matches_foreground():
+    deltas = writer_deltas()
+    texts = []
+    for background in (False, True):
+        out = io.StringIO()
+        with pd.Writer(out, color=True, chunk_size=7,
+                       background=background) as writer:
+            writer.write_deltas(deltas)
+            writer.note('done')
+        texts.append(out.getvalue())
+    assert texts[0] == texts[1]
+
+
+class BrokenPipe(io.StringIO):
+    def write(self, text: str):
+        raise BrokenPipeError
+
+
+def test_background_writer_raises_on_broken_pipe():
+    # far more chunks than the queue holds, so a drain thread that stopped
+    # draining would block the producer forever
+    writer = pd.Writer(BrokenPipe(), color=False, chunk_size=1,
+                       background=True)
+    with pytest.raises(BrokenPipeError):
+        writer.write_deltas(writer_deltas())
+        writer.close()
+
+
+def test_jsonl_writer_records(tmp_path):
+    db = pd.LiteDB(make_db(tmp_path / 'a.db', []))
+    out = io.StringIO()
+    with pd.JSONLWriter(out) as writer:
+        writer.begin_table('t', db.columns('t', ['id']))
+        writer.write_deltas([pd.Insert((1, 2, 3, 4)),
+                             pd.Delete((5, 6, 7, 8)),
+                             pd.Update((1, 2, 3, 4), (1, 2, 3, 5))])
+    recs = [json.loads(line) for line in out.getvalue().splitlines()]
+    row = lambda *vals: dict(zip('abcd', vals))
+    assert recs == [
+        {'table': 't', 'op': 'insert', 'new': row(1, 2, 3, 4)},
+        {'table': 't', 'op': 'delete', 'old': row(5, 6, 7, 8)},
+        {'table': 't', 'op': 'update', 'old': row(1, 2, 3, 4),
+         'new': row(1, 2, 3, 5)}]
+
+
+def test_parquet_writer_columns(tmp_path):
+    pq = pytest.importorskip('pyarrow.parquet')
+    db = pd.LiteDB(make_table(tmp_path / 'a.db', 'n INTEGER, s TEXT', []))
+    path = str(tmp_path / 'out.parquet')
+    with pd.ParquetWriter(path) as writer:
+        writer.begin_table('t', db.columns('t', ['id']))
+        writer.write_deltas([pd.Insert((1, 'x')),
+                             pd.Update((2, 'y'), (3, 'y'))])
+    assert pq.read_table(path).to_pylist() == [
+        {'op': 'insert', 'old_n': None, 'old_s': None,
+         'new_n': 1, 'new_s': 'x'},
+        {'op': 'update', 'old_n': 2, 'old_s': 'y',
+         'new_n': 3, 'new_s': 'y'}]
+
+
+def canon(type_name: str, *vals, **rules) -> list:
+    columns = [pd.LiteColumn('v', pd.LiteType(type_name))]
+    return [pd.Comparator(columns, **rules).canon2((v,))[0] for v in vals]
+
+
+def test_tolerance_snaps_to_grid():
+    a, b, c, d = canon('REAL', 1.0, 1.0000004, Decimal('1.0000004'),
+                       1.0000006, tolerance=1e-6)
+    assert a == b == c != d
+    # a grid, not a pairwise tolerance: close values either side of a grid
+    # line still differ
+    lo, hi = canon('NUMERIC', 1.4999e-6, 1.5001e-6, tolerance=1e-6)
+    assert lo != hi
+    inf, ninf, nan, null = canon('REAL', math.inf, -math.inf, math.nan,
+                                 None, tolerance=1e-6)
+    assert (inf, ninf, null) == (math.inf, -math.inf, None)
+    assert math.isnan(nan)
+    # other affinities are left alone
+    assert canon('INTEGER', 3, tolerance=10) == [3]
+
+
+def test_text_rules():
+    vals = ' Foo  BAR ', 'foo bar', '', None
+    assert canon('TEXT', *vals, ignore_case=True, ignore_space=True) == [
+        'foo bar', 'foo bar', '', None]
+    assert canon('TEXT', *vals, null_empty=True) == [
+        ' Foo  BAR ', 'foo bar', '', '']
+    assert canon('REAL', None, null_empty=True) == [None]
+
+
+def test_rules_in_diff_table(tmp_path):
+    cols = 'x REAL, s TEXT'
+    db1 = pd.LiteDB(make_table(tmp_path / 'a.db', cols,
+                               [(1.0, 'A  b'), (2.0, 'c')]))
+    db2 = pd.LiteDB(make_table(tmp_path / 'b.db', cols,
+                               [(1.0000001, 'a b'), (2.5, 'c')]))
+    rules = dict(tolerance=1e-3, ignore_case=True, ignore_space=True)
+    for intern in (False, True):
+        deltas = pd.diff_table(db1, db2, 't', intern=intern,
+                               progress=False, **rules)
+        # deltas carry the original rows, not the canonical ones
+        assert outcome(deltas) == outcome([pd.Update((2.0, 'c'),
+                                                     (2.5, 'c'))])
+    deltas = pd.diff_table(db1, db2, 't', progress=False)
+    assert outcome(deltas) == outcome([pd.Delete((1.0, 'A  b')),
+                                       pd.Insert((1.0000001, 'a b')),
+                                       pd.Update((2.0, 'c'), (2.5, 'c'))])
+
+
+def keyed_tables(rnd: random.Random, n: int) -> tuple[list, list]:
+    # keyed rows with some 10% updated, 5% deleted and 5% inserted
+    rows1 = [(f'k{i}', rnd.randint(0, 9), rnd.randint(0, 9))
+             for i in range(n)]
+    rows2 = []
+    for row in rows1:
+        r = rnd.random()
+        if r < 0.05:
+            continue
+        if r < 0.15:
+            row = row[:2] + (row[2] + 10,)
+        rows2.append(row)
+    rows2 += [(f'n{i}', 0, 0) for i in range(n // 20)]
+    return rows1, rows2
+
+
+def keyed_dbs(tmp_path, rows1: list, rows2: list) -> tuple:
+    cols = 'pdgid TEXT, b INTEGER, c INTEGER'
+    return (pd.LiteDB(make_table(tmp_path / 'a.db', cols, rows1)),
+            pd.LiteDB(make_table(tmp_path / 'b.db', cols, rows2)))
+
+
+def exact_summary(db1, db2, **opts) -> pd.Summary:
+    summary = pd.Summary('t', [c.name for c in db1.columns('t', ['id'])])
+    for d in pd.diff_table(db1, db2, 't', progress=False, **opts):
+        summary.add_delta(d)
+    return summary
+
+
+def test_full_sample_is_exact(tmp_path):
+    rnd = random.Random(7)
+    for k, key in enumerate([None, 'pdgid']):
+        path = tmp_path / str(k)
+        path.mkdir()
+        db1, db2 = keyed_dbs(path, *keyed_tables(rnd, 200))
+        exact = exact_summary(db1, db2, key=key)
+        est = pd.estimate_table(db1, db2, 't', 1.0, key=key)
+        for name in ('inserted', 'deleted', 'updated'):
+            n = getattr(exact, name)
+            assert getattr(est, name) == (n, n, n)
+        assert (est.rows1, est.rows2) == (200, len(db2.get_all('t')))
+
+
+def test_keyed_sample_intervals_contain_truth(tmp_path):
+    db1, db2 = keyed_dbs(tmp_path, *keyed_tables(random.Random(8), 4000))
+    exact = exact_summary(db1, db2, key='pdgid')
+    est = pd.estimate_table(db1, db2, 't', 0.2, key='pdgid')
+    for name in ('inserted', 'deleted', 'updated'):
+        _, lo, hi = getattr(est, name)
+        assert lo <= getattr(exact, name) <= hi
+    assert 0 < est.change_rate <= 1
+
+
+def test_change_rate_is_capped():
+    # scaled deletes and updates can overshoot the old row count
+    est = pd.Estimate('t', 10, 0, 0.1, (0, 0, 0), (10, 0, 30), (10, 0, 30),
+                      (0, 0, 0))
+    assert est.change_rate == 1.0
+    est = pd.Estimate('t', 10, 15, 0.1, (5, 0, 9), (0, 0, 0), (0, 0, 0),
+                      (10, 5, 10))
+    assert est.change_rate == 5 / 15
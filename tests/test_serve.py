@@ -0,0 +1,73 @@
+import json
+import os
+import sqlite3
+
+import pytest
+
+pytest.importorskip('sqlalchemy')
+
+from pdgapi_diff.cli import pdgapi_diff as pd
+from pdgapi_diff.cli.serve import DiffService
+
+
+def make_db(path, rows: list[tuple]) -> str:
+    conn = sqlite3.connect(path)
+    conn.execute('CREATE TABLE t (id INTEGER PRIMARY KEY, a INTEGER, '
+                 'b TEXT)')
+    conn.executemany('INSERT INTO t (a, b) VALUES (?, ?)', rows)
+    conn.commit()
+    conn.close()
+    return str(path)
+
+
+@pytest.fixture
+def paths(tmp_path) -> tuple[str, str]:
+    return (make_db(tmp_path / 'a.db', [(1, 'x'), (2, 'y')]),
+            make_db(tmp_path / 'b.db', [(1, 'x'), (2, 'z'), (9, 'q')]))
+
+
+def records(text: str) -> list[dict]:
+    return [json.loads(line) for line in text.splitlines()]
+
+
+def test_refuses_unsupported_options(tmp_path, paths):
+    service = DiffService()
+    state = str(tmp_path / 'state')
+    with pytest.raises(ValueError):
+        service.diff({'path1': paths[0], 'path2': paths[1], 'table': 't',
+                      'save_state': state})
+    assert not os.path.exists(state)
+
+
+def test_columns_option(paths):
+    service = DiffService()
+    text = service.diff({'path1': paths[0], 'path2': paths[1],
+                         'table': 't', 'columns': 'a'})
+    assert records(text) == [{'table': 't', 'op': 'insert',
+                              'new': {'a': 9}}]
+
+
+def test_results_cached_until_file_changes(paths):
+    service = DiffService()
+    request = {'path1': paths[0], 'path2': paths[1], 'table': 't'}
+    first = service.diff(request)
+    assert service.diff(dict(request)) is first
+    assert service.diff({**request, 'format': 'text'}) is not first
+
+    conn = sqlite3.connect(paths[1])
+    conn.executemany('INSERT INTO t (a, b) VALUES (?, ?)',
+                     [(7, 'w')] * 1000)
+    conn.commit()
+    conn.close()
+    assert len(records(service.diff(request))) == 1002
+
+
+def test_eviction_drops_reflection(tmp_path, paths):
+    third = make_db(tmp_path / 'c.db', [(1, 'x')])
+    service = DiffService(max_dbs=2)
+    service.diff({'path1': paths[0], 'path2': paths[1], 'table': 't'})
+    (key1, db1), (key2, db2) = service.dbs.items()
+    service.diff({'path1': paths[0], 'path2': third, 'table': 't'})
+    assert key1 in service.dbs and key2 not in service.dbs
+    assert db1.cache_key in pd._reflection_cache
+    assert db2.cache_key not in pd._reflection_cache